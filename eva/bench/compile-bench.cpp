@@ -0,0 +1,269 @@
+/**
+ * Compiler throughput benchmark
+ *
+ * Generates Eva programs of a given shape & size, then measures the
+ * tokenizer, the parser & code generation separately:
+ * tokens/s, AST nodes/s & IR instructions/s.
+ *
+ * Usage: ./compile-bench [--shape nesting|wide|defs|strings|comments|all]
+ *                        [--size N] [--reps N]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include "../src/EvaLLVM.h"
+
+// ------------------------------------------------------------------
+// Program generators
+
+/**
+ * (+ 1 (+ 1 ... (begin (+ 1 ...)) ...)): deeply nested expressions
+ */
+std::string genNesting(int size)
+{
+    std::string open, close;
+
+    for (auto i = 0; i < size; i++)
+    {
+        open += i % 8 == 7 ? "(begin (+ 1 " : "(+ 1 ";
+        close += i % 8 == 7 ? "))" : ")";
+    }
+
+    return "(var x " + open + "0" + close + ")\n";
+}
+
+/**
+ * One (begin ...) block with many statements
+ */
+std::string genWide(int size)
+{
+    std::string program = "(begin\n";
+
+    for (auto i = 0; i < size; i++)
+    {
+        auto var = "v" + std::to_string(i);
+        program += "  (var " + var + " " + std::to_string(i) + ")\n";
+        program += "  (set " + var + " (* " + var + " 2))\n";
+    }
+
+    return program + ")\n";
+}
+
+/**
+ * Many small functions, each called once
+ */
+std::string genDefs(int size)
+{
+    std::string program;
+
+    for (auto i = 0; i < size; i++)
+    {
+        auto k = std::to_string(i);
+        program += "(def f" + k + " (x) (if (> x " + k + ") (- x " + k + ") (+ x " + k + ")))\n";
+        program += "(f" + k + " " + k + ")\n";
+    }
+
+    return program;
+}
+
+/**
+ * Long string literals
+ */
+std::string genStrings(int size)
+{
+    std::string text(256, 'a');
+
+    for (auto i = 0; i < text.size(); i += 7)
+    {
+        text[i] = ' ';
+    }
+
+    std::string program;
+
+    for (auto i = 0; i < size; i++)
+    {
+        program += "(var (s" + std::to_string(i) + " string) \"" + text + "\")\n";
+    }
+
+    return program;
+}
+
+/**
+ * Mostly comments, few expressions
+ */
+std::string genComments(int size)
+{
+    std::string program;
+
+    for (auto i = 0; i < size; i++)
+    {
+        program += "// Line comment number " + std::to_string(i) + ", which the tokenizer skips\n";
+        program += "/* Block comment\n   spanning two lines */\n";
+        program += "(var c" + std::to_string(i) + " " + std::to_string(i) + ")\n";
+    }
+
+    return program;
+}
+
+// ------------------------------------------------------------------
+// Measurement
+
+struct Samples
+{
+    std::vector<double> ms;
+
+    double median() const
+    {
+        auto sorted = ms;
+        std::sort(sorted.begin(), sorted.end());
+        auto n = sorted.size();
+
+        return n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+
+    double mean() const
+    {
+        auto sum = 0.0;
+
+        for (auto x : ms)
+        {
+            sum += x;
+        }
+
+        return sum / ms.size();
+    }
+
+    // Relative standard deviation, in %
+    double rsd() const
+    {
+        auto m = mean();
+        auto sq = 0.0;
+
+        for (auto x : ms)
+        {
+            sq += (x - m) * (x - m);
+        }
+
+        return ms.size() < 2 || m == 0 ? 0 : 100 * std::sqrt(sq / (ms.size() - 1)) / m;
+    }
+};
+
+double timeMs(const std::function<void()> &work)
+{
+    auto start = std::chrono::steady_clock::now();
+    work();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
+
+void report(const char *stage, const Samples &samples, uint64_t units, const char *unit)
+{
+    auto median = samples.median();
+
+    std::printf("  %-10s %10.3f ms  (mean %10.3f, rsd %5.1f%%)  %12.0f %s/s\n",
+                stage, median, samples.mean(), samples.rsd(), median > 0 ? units / (median / 1000) : 0.0, unit);
+}
+
+void bench(const std::string &shape, const std::string &source, int reps)
+{
+    syntax::EvaParser parser;
+
+    Samples tokenizer, parse, codegen;
+    uint64_t tokens = 0, nodes = 0, instructions = 0;
+
+    // First round warms up caches & the allocator, & isn't recorded
+    for (auto rep = 0; rep <= reps; rep++)
+    {
+        auto tokenizeMs = timeMs([&]
+                                 {
+            parser.tokenizer.initString("(begin " + source + ")");
+            tokens = 0;
+
+            while (parser.tokenizer.getNextToken()->type != syntax::TokenType::__EOF)
+            {
+                tokens++;
+            } });
+
+        auto parseMs = timeMs([&]
+                              { parser.parse("(begin " + source + ")"); });
+
+        EvaOptions options;
+        options.printIR = false;
+        options.outputFile = "";
+
+        EvaLLVM vm(options);
+        vm.exec(source);
+
+        nodes = vm.getStats().counter("astNodes");
+        instructions = vm.getStats().counter("instructions");
+
+        if (rep > 0)
+        {
+            tokenizer.ms.push_back(tokenizeMs);
+            parse.ms.push_back(parseMs);
+            codegen.ms.push_back(vm.getStats().phaseMs("EvaLLVM::generate"));
+        }
+    }
+
+    std::printf("%s: %zu bytes, %lu tokens, %lu AST nodes, %lu IR instructions\n",
+                shape.c_str(), source.size(), tokens, nodes, instructions);
+
+    report("tokenizer", tokenizer, tokens, "tokens");
+    report("parser", parse, nodes, "nodes");
+    report("codegen", codegen, instructions, "instructions");
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string shape = "all";
+    auto size = 100;
+    auto reps = 5;
+
+    for (auto i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--shape")
+        {
+            shape = argv[i + 1];
+        }
+        else if (arg == "--size")
+        {
+            size = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--reps")
+        {
+            reps = std::max(1, std::stoi(argv[i + 1]));
+        }
+    }
+
+    std::map<std::string, std::function<std::string(int)>> generators{
+        {"nesting", genNesting},
+        {"wide", genWide},
+        {"defs", genDefs},
+        {"strings", genStrings},
+        {"comments", genComments},
+    };
+
+    if (shape != "all" && generators.count(shape) == 0)
+    {
+        DIE << "unknown shape " << shape;
+    }
+
+    std::printf("size %d, median of %d runs\n\n", size, reps);
+
+    for (auto &generator : generators)
+    {
+        if (shape == "all" || shape == generator.first)
+        {
+            bench(generator.first, generator.second(size), reps);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Compiler throughput: tokenizer, parser & codegen on generated programs.
+# Arguments are passed on, e.g. ./compile-bench.sh --shape defs --size 2000
+
+cd "$(dirname "$0")"
+
+clang++ -O2 -o compile-bench `llvm-config --cxxflags --ldflags --system-libs --libs core irreader linker ipo passes orcjit native all-targets lto` -std=c++17 -fcxx-exceptions compile-bench.cpp
+
+./compile-bench "$@"
@@ -0,0 +1,248 @@
+/**
+ * Generated-code benchmark
+ *
+ * Compiles each Eva program at -O0 ... -O3 and runs it
+ * - in-process through the JIT, eager or lazy (machine code per function
+ *   on its first call)
+ * - as a native executable (object file linked with the runtime)
+ * reporting run time, instructions retired & object code size.
+ *
+ * Usage: ./run-bench [program.eva ...]   (default: programs/*.eva)
+ *
+ * The runtime library for native executables is ./libeva-runtime.a,
+ * or $EVA_RUNTIME_LIB. Instruction counts need perf events
+ * (kernel.perf_event_paranoid <= 2), otherwise they're shown as n/a.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../src/EvaLLVM.h"
+#include "../src/EvaJIT.h"
+
+// The runtime is linked into this binary, for JIT'ed code
+extern "C" void eva_flush();
+
+/**
+ * Instructions retired in user space by this process & the children
+ * started while counting
+ */
+class InstructionCounter
+{
+public:
+    InstructionCounter()
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~InstructionCounter()
+    {
+        if (fd_ >= 0)
+        {
+            close(fd_);
+        }
+    }
+
+    void start()
+    {
+        if (fd_ >= 0)
+        {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // -1 if not available
+    int64_t stop()
+    {
+        int64_t count = -1;
+
+        if (fd_ < 0)
+        {
+            return count;
+        }
+
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(fd_, &count, sizeof(count)) != sizeof(count))
+        {
+            return -1;
+        }
+
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+struct RunResult
+{
+    double ms;
+    int64_t instructions;
+};
+
+/**
+ * Runs `work` with stdout going to /dev/null
+ */
+template <typename Work>
+RunResult measure(Work work)
+{
+    std::fflush(stdout);
+
+    auto savedStdout = dup(STDOUT_FILENO);
+    auto devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    InstructionCounter counter;
+
+    auto start = std::chrono::steady_clock::now();
+    counter.start();
+
+    work();
+
+    auto instructions = counter.stop();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    return {elapsed.count(), instructions};
+}
+
+EvaOptions benchOptions(int optLevel)
+{
+    EvaOptions options;
+    options.optLevel = optLevel;
+    options.printIR = false;
+    options.outputFile = "";
+
+    return options;
+}
+
+RunResult runJIT(const std::string &source, int optLevel, bool lazy)
+{
+    EvaLLVM vm(benchOptions(optLevel));
+    vm.exec(source);
+
+    EvaJITOptions jitOptions;
+    jitOptions.lazy = lazy;
+
+    EvaJIT jit(jitOptions);
+    jit.addModule(vm.takeModule());
+
+    return measure([&]
+                   {
+        jit.runMain();
+        eva_flush(); });
+}
+
+/**
+ * Returns the run result & the size of the program's object code
+ */
+std::pair<RunResult, uintmax_t> runNative(const std::string &source, int optLevel)
+{
+    auto objectFile = "./bench-out.o";
+    auto executable = "./bench-out";
+
+    auto options = benchOptions(optLevel);
+    options.objectFile = objectFile;
+
+    EvaLLVM vm(options);
+    vm.exec(source);
+
+    auto runtimeLib = std::getenv("EVA_RUNTIME_LIB") != nullptr ? std::getenv("EVA_RUNTIME_LIB") : "./libeva-runtime.a";
+    auto linkCommand = std::string("c++ -o ") + executable + " " + objectFile + " " + runtimeLib + " -pthread";
+
+    if (std::system(linkCommand.c_str()) != 0)
+    {
+        DIE << "linking failed: " << linkCommand;
+    }
+
+    auto result = measure([&]
+                          {
+        auto pid = fork();
+
+        if (pid == 0)
+        {
+            execl(executable, executable, nullptr);
+            _exit(127);
+        }
+
+        int status;
+        waitpid(pid, &status, 0); });
+
+    auto size = std::filesystem::file_size(objectFile);
+
+    std::remove(objectFile);
+    std::remove(executable);
+
+    return {result, size};
+}
+
+void printRow(const std::string &program, int optLevel, const char *mode, const RunResult &result, const std::string &size)
+{
+    auto instructions = result.instructions >= 0 ? std::to_string(result.instructions) : std::string("n/a");
+
+    std::printf("%-12s -O%d  %-6s %12.2f %16s %12s\n",
+                program.c_str(), optLevel, mode, result.ms, instructions.c_str(), size.c_str());
+}
+
+int main(int argc, char const *argv[])
+{
+    std::vector<std::string> programs(argv + 1, argv + argc);
+
+    if (programs.empty())
+    {
+        for (auto &entry : std::filesystem::directory_iterator("./programs"))
+        {
+            if (entry.path().extension() == ".eva")
+            {
+                programs.push_back(entry.path().string());
+            }
+        }
+
+        std::sort(programs.begin(), programs.end());
+    }
+
+    std::printf("%-12s %-4s %-6s %12s %16s %12s\n", "program", "opt", "mode", "time (ms)", "instructions", "object (B)");
+
+    for (auto &program : programs)
+    {
+        std::ifstream in(program);
+        std::stringstream source;
+        source << in.rdbuf();
+
+        auto name = std::filesystem::path(program).stem().string();
+
+        for (auto optLevel = 0; optLevel <= 3; optLevel++)
+        {
+            printRow(name, optLevel, "jit", runJIT(source.str(), optLevel, false), "-");
+            printRow(name, optLevel, "lazy", runJIT(source.str(), optLevel, true), "-");
+
+            auto native = runNative(source.str(), optLevel);
+            printRow(name, optLevel, "native", native.first, std::to_string(native.second));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# Generated-code benchmark: programs/*.eva at -O0 ... -O3, JIT (eager & lazy) & native.
+# Arguments (program files) are passed on.
+
+cd "$(dirname "$0")"
+
+# Runtime for native executables
+for src in ../runtime/*.cpp; do
+    clang++ -c -O2 -std=c++17 "$src" -o "$(basename "${src%.cpp}").o"
+done
+
+ar rcs libeva-runtime.a ./*.o
+rm ./*.o
+
+# The harness carries the runtime too, for JIT'ed code (-rdynamic exports it)
+clang++ -O2 -o run-bench `llvm-config --cxxflags --ldflags --system-libs --libs core irreader linker ipo passes orcjit perfjitevents native all-targets lto` -std=c++17 -fcxx-exceptions -rdynamic -pthread run-bench.cpp ../runtime/*.cpp
+
+./run-bench "$@"
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Eva runtime as LLVM bitcode: EvaLLVM links it into every program
+# before optimization, so small helpers get inlined.
+# Output: ./eva-runtime.bc
+
+for src in runtime/*.cpp; do
+    clang++ -c -emit-llvm -O2 -std=c++17 "$src" -o "${src%.cpp}.bc"
+done
+
+llvm-link runtime/*.bc -o eva-runtime.bc
+
+rm runtime/*.bc
@@ -1,9 +1,15 @@
 #!/bin/bash
 
-clang++ -o eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core` -fcxx-exceptions eva-llvm.cpp
+clang++ -o eva-llvm `llvm-config --cxxflags --ldflags --system-libs --libs core irreader linker ipo passes orcjit perfjitevents native all-targets lto` -std=c++17 -fcxx-exceptions eva-llvm.cpp
+
+# Eva runtime bitcode, linked into out.ll by ./eva-llvm
+./build-runtime.sh
 
 ./eva-llvm
 
-lli ./out.ll
+# Loop vectorizer needs the target to know the vector width
+opt -O3 -mtriple=`llvm-config --host-target` -S ./out.ll -o ./out-opt.ll
+
+lli ./out-opt.ll
 
 printf "\nReturn code: %s\n" "$?"
@@ -1,7 +1,11 @@
 #include "./src/EvaLLVM.h"
+#include "./src/EvaJIT.h"
+#include "./src/EvaBuild.h"
 
 int main(int argc, char const *argv[])
 {
+    // Debug info points into this file
+    auto programLine = __LINE__ + 1;
     std::string program = R"(
 
         // (printf "\nValue: %d\n" 43)
@@ -46,6 +50,18 @@ int main(int argc, char const *argv[])
 
         // (printf "X: %d\n" x)
 
+        // Multiway branches: switch becomes a jump table or lookup table
+        // (var day 3)
+        // (printf "Hours: %d\n" (switch day ((0 6) 0) (5 4) (default 8)))
+        // (printf "Sign: %d\n" (cond ((< x 42) 1) ((> x 42) 2) (else 0)))
+
+        // Logic: cheap operands are combined without branches,
+        // the array access is only evaluated when i is in bounds
+        // (var i 3)
+        // (var (xs (array number 4)))
+        // (printf "In range: %d\n" (and (>= i 0) (< i 4) (not (== i 2))))
+        // (printf "Positive: %d\n" (and (< i 4) (> (get xs i) 0)))
+
         // (var x 10)
 
         // (while (> x 0)
@@ -55,6 +71,104 @@ int main(int argc, char const *argv[])
         //         )
         //     )
 
+        // SIMD vectors
+        // (var (a (vec f64 4)) (vector (vec f64 4) 1 2 3 4))
+        // (var (b (vec f64 4)) (splat (vec f64 4) 2))
+        // (printf "Sum: %f\n" (reduce-add (+ (* a b) 1)))
+        // (printf "Max: %f\n" (reduce-max (select (< a b) b a)))
+
+        // Arrays
+        // (var (a (array number 100)))
+        // (var (b (array number)) (make-array number 100))
+        // (var i 0)
+        // (while (< i 100)
+        //     (begin
+        //         (set (get a i) i)
+        //         (set (get b i) (* 2 (get a i)))
+        //         (set i (+ i 1))))
+        // (printf "b[7]: %d\n" (get b 7))
+
+        // Structs
+        // (struct Point (x number) (y number))
+        // (var (p Point) (Point 3 4))
+        // (set (field p y) 40)
+        // (printf "Point: %d %d\n" (field p x) (field p y))
+
+        // Arrays of SoA structs: same access syntax, one array per field
+        // (struct (Particle soa) (pos f64) (vel f64))
+        // (var (particles (array Particle 100)))
+        // (set (field (get particles 5) vel) 2)
+        // (printf "Velocity: %f\n" (field (get particles 5) vel))
+
+        // Intrinsics: single instructions where the target has them
+        // (var bits 1000)
+        // (printf "Bits: %d, leading zeros: %d\n" (popcount bits) (ctlz bits))
+        // (printf "Hypot: %f\n" (sqrt (fma 3 3 (* 4 4))))
+        // (if (expect (> bits 0) true)
+        //     (printf "Min: %d\n" (min bits 10))
+        //     (printf "Max: %d\n" (max bits 10)))
+
+        // Memoized pure functions: the recursion goes through a cache
+        // (defmemo fib (n)
+        //     (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+        // (printf "fib(40): %d\n" (fib 40))
+        // (defmemo (grid 256 keep) (r c)
+        //     (if (== r 0) 1 (if (== c 0) 1 (+ (grid (- r 1) c) (grid r (- c 1))))))
+        // (printf "Paths: %d\n" (grid 16 16))
+
+        // Counted loops, optionally with optimizer hints
+        // (var (squares (array number 64)))
+        // (for (i 0 64) (unroll 4) (vectorize 8)
+        //     (set (get squares i) (* i i)))
+        // (for (i 10 0 (- 0 2)) (printf "%d " (get squares i)))
+
+        // Parallel loops: chunks of the range run on all cores
+        // (var (cubes (array number)) (make-array number 1000))
+        // (parallel-for (i 0 1000)
+        //     (set (get cubes i) (* i (* i i))))
+        // (printf "Cube: %d\n" (get cubes 10))
+
+        // Regions: arrays made inside are all freed at once on exit
+        // (var total 0)
+        // (for (k 0 100)
+        //     (set total (+ total (with-region
+        //         (var (tmp (array number)) (make-array number 1000))
+        //         (for (i 0 1000) (set (get tmp i) (* i k)))
+        //         (get tmp 999)))))
+        // (printf "Total: %d\n" total)
+
+        // Strings: SIMD kernels in the runtime, parts end with a null entry
+        // (var (line string) "GET /index.html 200, POST /api/items 201")
+        // (printf "Length: %d, POST at: %d\n" (str-len line) (str-find line "POST"))
+        // (var (parts (array string)) (str-split line ", "))
+        // (var i 0)
+        // (while (!= (get parts i) 0)
+        //     (begin
+        //         (printf "%s\n" (str-concat "> " (get parts i)))
+        //         (set i (+ i 1))))
+
+        // Async tasks (coroutines), driven by the runtime's event loop
+        // (defasync countdown (id n)
+        //     (begin
+        //         (while (> n 0)
+        //             (begin
+        //                 (printf "Task %d: %d\n" id n)
+        //                 (set n (- n 1))
+        //                 (yield)))
+        //         id))
+        // (defasync both ()
+        //     (begin
+        //         (var (a task) (countdown 1 3))
+        //         (var (b task) (countdown 2 2))
+        //         (+ (await a) (await b))))
+        // (printf "Done: %d\n" (await (both)))
+
+        // Buffered output: literal printf formats are split into these at compile time
+        // (print-str "Answer: ")
+        // (print-int 42)
+        // (print-char 10)
+        // (flush)
+
         (def square (x) (* x x))
         (square 2)
 
@@ -64,9 +178,119 @@ int main(int argc, char const *argv[])
         (printf "\n(+ (square 2) (sum 2 3)): %d\n" (+ (square 2) (sum 2 3)))
     )";
 
-    EvaLLVM vm;
+    EvaOptions options;
+    EvaJITOptions jitOptions;
+    auto jit = false;
+    std::string buildFile, executable;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Trap on integer overflow
+        if (arg == "--checked")
+        {
+            options.checkedArithmetic = true;
+        }
+        // Optimize in-process: -O0 ... -O3
+        else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && isdigit(arg[2]))
+        {
+            options.optLevel = arg[2] - '0';
+        }
+        // Phase timings & counters as JSON: --stats stats.json
+        else if (arg == "--stats" && i + 1 < argc)
+        {
+            options.statsFile = argv[++i];
+        }
+        // Target: --target x86_64-unknown-linux-gnu, --mcpu skylake (default: the host)
+        else if (arg == "--target" && i + 1 < argc)
+        {
+            options.targetTriple = argv[++i];
+        }
+        else if (arg == "--mcpu" && i + 1 < argc)
+        {
+            options.targetCPU = argv[++i];
+        }
+        // Object file for the target: --emit-obj out.o
+        else if (arg == "--emit-obj" && i + 1 < argc)
+        {
+            options.objectFile = argv[++i];
+        }
+        // Call counts, cycles & loop iterations, printed at exit
+        else if (arg == "--instrument")
+        {
+            options.instrument = true;
+        }
+        // PGO: instrumented build, then a build using the merged profile
+        else if (arg == "--pgo-gen" && i + 1 < argc)
+        {
+            options.pgoGenerate = argv[++i];
+        }
+        else if (arg == "--pgo-use" && i + 1 < argc)
+        {
+            options.pgoUse = argv[++i];
+        }
+        // DWARF line info, for perf, gdb & addr2line
+        else if (arg == "-g")
+        {
+            options.debugInfo = true;
+            options.sourceFile = __FILE__;
+            options.firstLine = programLine;
+        }
+        // Separate compilation & ThinLTO: --build main.eva [-o main]
+        else if (arg == "--build" && i + 1 < argc)
+        {
+            buildFile = argv[++i];
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            executable = argv[++i];
+        }
+        // Run in-process after compiling
+        else if (arg == "--jit")
+        {
+            jit = true;
+        }
+        // Make JIT'ed code visible to gdb (with -g) or perf
+        else if (arg == "--jit-gdb")
+        {
+            jit = jitOptions.gdb = true;
+        }
+        else if (arg == "--jit-perf")
+        {
+            jit = jitOptions.perf = true;
+        }
+        // Machine code per function, on its first call
+        else if (arg == "--jit-lazy")
+        {
+            jit = jitOptions.lazy = true;
+        }
+    }
+
+    if (!buildFile.empty())
+    {
+        EvaBuild(options).build(buildFile, executable.empty() ? llvm::sys::path::stem(buildFile).str() : executable);
+
+        return 0;
+    }
+
+    // JIT'ed code calls the runtime: linked in as bitcode, or part of this binary
+    if (jit && !llvm::sys::fs::exists(EvaLLVM::runtimeBitcode) && !EvaJIT::hostDefines("eva_flush"))
+    {
+        DIE << "--jit needs the Eva runtime: " << EvaLLVM::runtimeBitcode << " is missing (run ./build-runtime.sh)";
+    }
+
+    EvaLLVM vm(options);
 
     vm.exec(program);
 
+    if (jit)
+    {
+        EvaJIT evaJIT(jitOptions);
+        evaJIT.addModule(vm.takeModule());
+
+        return evaJIT.runMain();
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+/**
+ * Eva runtime: single-threaded event loop for (defasync ...) tasks
+ *
+ * Tasks are switch-resumed LLVM coroutines. Their frame starts with
+ * the resume & destroy function pointers; the resume pointer is null
+ * once the task reached its final suspension point (i.e. it's done).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+namespace
+{
+    struct CoroFrame
+    {
+        void (*resume)(void *);
+        void (*destroy)(void *);
+    };
+
+    // Suspended tasks that can continue
+    std::deque<void *> readyQueue;
+
+    bool isDone(void *task)
+    {
+        return ((CoroFrame *)task)->resume == nullptr;
+    }
+}
+
+/**
+ * Queues a suspended task for resumption. Null is ignored.
+ */
+extern "C" void eva_schedule(void *task)
+{
+    if (task != nullptr)
+    {
+        readyQueue.push_back(task);
+    }
+}
+
+/**
+ * Runs ready tasks until `task` is done
+ */
+extern "C" void eva_await(void *task)
+{
+    while (!isDone(task))
+    {
+        if (readyQueue.empty())
+        {
+            std::fprintf(stderr, "Fatal Error: awaited task can never finish.\n");
+            std::exit(EXIT_FAILURE);
+        }
+
+        auto next = readyQueue.front();
+        readyQueue.pop_front();
+
+        ((CoroFrame *)next)->resume(next);
+    }
+}
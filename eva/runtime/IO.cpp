@@ -0,0 +1,196 @@
+/**
+ * Eva runtime: buffered output
+ *
+ * Typed print primitives append to one large user-space buffer, which is
+ * written out with a single write() when full & at exit. Literal-format
+ * (printf ...) calls are split into these primitives at compile time;
+ * other formats go through eva_printf, which formats into the same
+ * buffer, so output order is preserved.
+ */
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+
+namespace
+{
+    constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    // Room needed by the largest formatted scalar (%f of a huge double)
+    constexpr size_t MAX_SCALAR_SIZE = 512;
+
+    char buffer[BUFFER_SIZE];
+    size_t used = 0;
+
+    // Parallel loops may print from several threads
+    std::mutex bufferMutex;
+
+    void flushLocked()
+    {
+        size_t written = 0;
+
+        while (written < used)
+        {
+            auto n = write(STDOUT_FILENO, buffer + written, used - written);
+
+            if (n <= 0)
+            {
+                break;
+            }
+
+            written += n;
+        }
+
+        used = 0;
+    }
+
+    void reserve(size_t size)
+    {
+        if (used + size > BUFFER_SIZE)
+        {
+            flushLocked();
+        }
+    }
+
+    int32_t appendLocked(const char *str, size_t len)
+    {
+        // Too big to ever fit: bypass the buffer
+        if (len > BUFFER_SIZE)
+        {
+            flushLocked();
+            auto ignored = write(STDOUT_FILENO, str, len);
+            (void)ignored;
+            return len;
+        }
+
+        reserve(len);
+        std::memcpy(buffer + used, str, len);
+        used += len;
+
+        return len;
+    }
+
+    // Flushes whatever is left once the program exits
+    struct ExitFlush
+    {
+        ~ExitFlush()
+        {
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            flushLocked();
+        }
+    } exitFlush;
+}
+
+extern "C" void eva_flush()
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    flushLocked();
+}
+
+extern "C" int32_t eva_print_strn(const char *str, int64_t len)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    return appendLocked(str, len);
+}
+
+extern "C" int32_t eva_print_str(const char *str)
+{
+    return eva_print_strn(str, std::strlen(str));
+}
+
+extern "C" int32_t eva_print_char(int32_t c)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    reserve(1);
+    buffer[used++] = (char)c;
+
+    return 1;
+}
+
+extern "C" int32_t eva_print_int(int64_t value)
+{
+    // Digits are produced backwards
+    char digits[24];
+    auto end = digits + sizeof(digits);
+    auto pos = end;
+
+    auto magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    do
+    {
+        *--pos = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (value < 0)
+    {
+        *--pos = '-';
+    }
+
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    return appendLocked(pos, end - pos);
+}
+
+extern "C" int32_t eva_print_f64(double value)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    reserve(MAX_SCALAR_SIZE);
+
+    auto len = std::snprintf(buffer + used, MAX_SCALAR_SIZE, "%f", value);
+    used += len;
+
+    return len;
+}
+
+/**
+ * Fallback for formats not split at compile time
+ */
+extern "C" int32_t eva_printf(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    auto len = std::vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        return len;
+    }
+
+    // Formatted size, with the terminating zero
+    size_t size = len + 1;
+
+    std::lock_guard<std::mutex> lock(bufferMutex);
+
+    if (size > BUFFER_SIZE - used)
+    {
+        flushLocked();
+    }
+
+    // Longer than the whole buffer: format on the heap
+    if (size > BUFFER_SIZE)
+    {
+        auto str = new char[size];
+
+        va_start(args, format);
+        std::vsnprintf(str, size, format, args);
+        va_end(args);
+
+        appendLocked(str, len);
+        delete[] str;
+
+        return len;
+    }
+
+    va_start(args, format);
+    std::vsnprintf(buffer + used, size, format, args);
+    va_end(args);
+
+    used += len;
+
+    return len;
+}
@@ -0,0 +1,247 @@
+/**
+ * Eva runtime: work-stealing thread pool for (parallel-for ...)
+ *
+ * The iteration space is cut into chunks which are dealt out to
+ * per-worker deques. A worker pops chunks from the back of its own
+ * deque, and once it runs dry steals from the front of the others.
+ * The calling thread takes part as worker 0.
+ *
+ * Built into the runtime bitcode by build-runtime.sh
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using LoopBody = void (*)(int32_t, int32_t, void *);
+
+namespace
+{
+    struct Chunk
+    {
+        int32_t start;
+        int32_t end;
+    };
+
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    class ThreadPool
+    {
+    public:
+        ThreadPool(int numThreads) : queues_(numThreads)
+        {
+            for (auto &queue : queues_)
+            {
+                queue = std::make_unique<WorkQueue>();
+            }
+
+            for (auto id = 1; id < numThreads; id++)
+            {
+                threads_.emplace_back([this, id]
+                                      { workerLoop(id); });
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                shutdown_ = true;
+            }
+            wakeUp_.notify_all();
+
+            for (auto &thread : threads_)
+            {
+                thread.join();
+            }
+        }
+
+        int size() { return queues_.size(); }
+
+        /**
+         * False if a job is already running (e.g. a nested parallel-for):
+         * the caller should run the loop itself
+         */
+        bool tryRun(int32_t start, int32_t end, LoopBody body, void *ctx)
+        {
+            auto expected = false;
+
+            if (!busy_.compare_exchange_strong(expected, true))
+            {
+                return false;
+            }
+
+            run(start, end, body, ctx);
+            busy_ = false;
+
+            return true;
+        }
+
+    private:
+        void run(int32_t start, int32_t end, LoopBody body, void *ctx)
+        {
+            // ~8 chunks per worker leaves room for balancing
+            int64_t count = (int64_t)end - start;
+            int64_t grain = std::max<int64_t>(1, count / (size() * 8));
+            int64_t numChunks = (count + grain - 1) / grain;
+
+            // Published before any chunk: a worker still draining the
+            // previous job may pick up new chunks right away
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                body_ = body;
+                ctx_ = ctx;
+                remaining_ = numChunks;
+            }
+
+            for (int64_t i = 0; i < numChunks; i++)
+            {
+                // Contiguous runs of chunks per worker keep locality
+                auto &queue = *queues_[i * size() / numChunks];
+                auto chunkStart = start + i * grain;
+
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.chunks.push_back({(int32_t)chunkStart, (int32_t)std::min<int64_t>(chunkStart + grain, end)});
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                generation_++;
+            }
+            wakeUp_.notify_all();
+
+            work(0);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this]
+                       { return remaining_ == 0; });
+        }
+
+        void workerLoop(int id)
+        {
+            uint64_t seen = 0;
+
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wakeUp_.wait(lock, [&]
+                                 { return shutdown_ || generation_ != seen; });
+
+                    if (shutdown_)
+                    {
+                        return;
+                    }
+
+                    seen = generation_;
+                }
+
+                work(id);
+            }
+        }
+
+        void work(int id)
+        {
+            Chunk chunk;
+
+            while (popOwn(id, chunk) || steal(id, chunk))
+            {
+                body_(chunk.start, chunk.end, ctx_);
+
+                if (remaining_.fetch_sub(1) == 1)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    done_.notify_all();
+                }
+            }
+        }
+
+        bool popOwn(int id, Chunk &chunk)
+        {
+            auto &queue = *queues_[id];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (queue.chunks.empty())
+            {
+                return false;
+            }
+
+            chunk = queue.chunks.back();
+            queue.chunks.pop_back();
+            return true;
+        }
+
+        bool steal(int thief, Chunk &chunk)
+        {
+            for (auto i = 1; i < size(); i++)
+            {
+                auto &queue = *queues_[(thief + i) % size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+
+                if (!queue.chunks.empty())
+                {
+                    chunk = queue.chunks.front();
+                    queue.chunks.pop_front();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        std::vector<std::unique_ptr<WorkQueue>> queues_;
+        std::vector<std::thread> threads_;
+
+        // One parallel-for at a time
+        std::atomic<bool> busy_{false};
+
+        std::mutex mutex_;
+        std::condition_variable wakeUp_;
+        std::condition_variable done_;
+        uint64_t generation_ = 0;
+        bool shutdown_ = false;
+
+        LoopBody body_ = nullptr;
+        void *ctx_ = nullptr;
+        std::atomic<int64_t> remaining_{0};
+    };
+
+    ThreadPool &getPool()
+    {
+        // EVA_NUM_THREADS overrides the hardware thread count
+        static ThreadPool pool([]
+                               {
+            auto env = std::getenv("EVA_NUM_THREADS");
+            auto n = env != nullptr ? std::atoi(env) : (int)std::thread::hardware_concurrency();
+            return std::max(1, n); }());
+
+        return pool;
+    }
+}
+
+/**
+ * Runs body(chunkStart, chunkEnd, ctx) over [start, end)
+ */
+extern "C" void eva_parallel_for(int32_t start, int32_t end, LoopBody body, void *ctx)
+{
+    if (start >= end)
+    {
+        return;
+    }
+
+    if (getPool().size() == 1 || !getPool().tryRun(start, end, body, ctx))
+    {
+        body(start, end, ctx);
+    }
+}
@@ -0,0 +1,88 @@
+/**
+ * Eva runtime: flat profile of --instrument builds
+ *
+ * The compiler emits a counter table (calls, cycles with & without callees
+ * per function; iterations per loop) & passes it here when main returns.
+ * The profile is printed to stderr, after the program's output.
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+extern "C" void eva_flush();
+
+namespace
+{
+    /**
+     * Layout of the compiler's `prof.entry`
+     */
+    struct ProfileEntry
+    {
+        const char *name;
+        int64_t isLoop;
+        int64_t *count;
+        int64_t *cycles;
+        int64_t *selfCycles;
+    };
+}
+
+extern "C" void eva_profile_report(const void *entries, int64_t tableSize)
+{
+    auto table = (const ProfileEntry *)entries;
+
+    std::vector<const ProfileEntry *> functions, loops;
+    int64_t totalSelf = 0;
+
+    for (auto i = 0; i < tableSize; i++)
+    {
+        auto &entry = table[i];
+
+        if (*entry.count == 0)
+        {
+            continue;
+        }
+
+        if (entry.isLoop)
+        {
+            loops.push_back(&entry);
+        }
+        else
+        {
+            functions.push_back(&entry);
+            totalSelf += *entry.selfCycles;
+        }
+    }
+
+    std::sort(functions.begin(), functions.end(), [](auto a, auto b)
+              { return *a->selfCycles > *b->selfCycles; });
+
+    std::sort(loops.begin(), loops.end(), [](auto a, auto b)
+              { return *a->count > *b->count; });
+
+    // Program output first
+    eva_flush();
+
+    std::fprintf(stderr, "\nFlat profile:\n\n");
+    std::fprintf(stderr, "%7s %16s %16s %12s %14s  %s\n", "% self", "self cycles", "total cycles", "calls", "cycles/call", "function");
+
+    for (auto entry : functions)
+    {
+        std::fprintf(stderr, "%7.2f %16" PRId64 " %16" PRId64 " %12" PRId64 " %14" PRId64 "  %s\n",
+                     totalSelf > 0 ? 100.0 * *entry->selfCycles / totalSelf : 0.0,
+                     *entry->selfCycles, *entry->cycles, *entry->count,
+                     *entry->cycles / *entry->count, entry->name);
+    }
+
+    if (!loops.empty())
+    {
+        std::fprintf(stderr, "\n%16s  %s\n", "iterations", "loop");
+
+        for (auto entry : loops)
+        {
+            std::fprintf(stderr, "%16" PRId64 "  %s\n", *entry->count, entry->name);
+        }
+    }
+}
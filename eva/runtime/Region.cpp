@@ -0,0 +1,233 @@
+/**
+ * Eva runtime: region (arena) allocator
+ *
+ * Arrays & strings are bump-allocated from the innermost region and
+ * released all at once when the region is popped, i.e. at the end of
+ * (with-region ...). The outermost region lives as long as the program.
+ *
+ * Every thread has a region stack of its own (thread_local; the JIT
+ * emulates TLS), so allocation takes no lock. A parallel-for body runs
+ * in a worker region entered from the loop's enclosing region: when the
+ * chunk is done its memory is handed over to that region, & is freed
+ * with it.
+ *
+ * Chunks of released regions are kept for reuse, so steady-state
+ * allocation doesn't touch malloc at all.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    constexpr size_t CHUNK_SIZE = 1 << 16;
+    constexpr size_t ALIGNMENT = 16;
+
+    /**
+     * Header at the start of every chunk
+     */
+    struct alignas(ALIGNMENT) Chunk
+    {
+        Chunk *next;
+        size_t size;
+    };
+
+    /**
+     * Lives at the start of its first chunk
+     */
+    struct alignas(ALIGNMENT) Region
+    {
+        Region *parent;
+        Chunk *chunks;
+
+        // Bump pointer into the first chunk
+        char *cursor;
+        char *limit;
+
+        // Memory of worker regions that ran inside this one
+        std::atomic<Chunk *> adopted;
+
+        // Worker region: memory goes to `owner` when it's left
+        Region *owner;
+    };
+
+    // Innermost region of this thread
+    thread_local Region *current = nullptr;
+
+    // Standard-size chunks of popped regions
+    thread_local Chunk *freeChunks = nullptr;
+
+    Chunk *newChunk(size_t size)
+    {
+        if (size == CHUNK_SIZE && freeChunks != nullptr)
+        {
+            auto chunk = freeChunks;
+            freeChunks = chunk->next;
+            return chunk;
+        }
+
+        auto chunk = (Chunk *)std::aligned_alloc(ALIGNMENT, size);
+
+        if (chunk == nullptr)
+        {
+            std::fprintf(stderr, "Fatal Error: out of memory.\n");
+            std::exit(EXIT_FAILURE);
+        }
+
+        chunk->size = size;
+        return chunk;
+    }
+
+    void releaseChunks(Chunk *chunk)
+    {
+        while (chunk != nullptr)
+        {
+            auto next = chunk->next;
+
+            if (chunk->size == CHUNK_SIZE)
+            {
+                chunk->next = freeChunks;
+                freeChunks = chunk;
+            }
+            else
+            {
+                std::free(chunk);
+            }
+
+            chunk = next;
+        }
+    }
+
+    Region *pushRegion(Region *owner)
+    {
+        auto chunk = newChunk(CHUNK_SIZE);
+        chunk->next = nullptr;
+
+        auto region = new (chunk + 1) Region{current, chunk, nullptr, (char *)chunk + CHUNK_SIZE, {nullptr}, owner};
+        region->cursor = (char *)(region + 1);
+
+        return current = region;
+    }
+
+    Region *currentRegion()
+    {
+        return current != nullptr ? current : pushRegion(nullptr);
+    }
+}
+
+extern "C" void eva_region_push()
+{
+    currentRegion();
+    pushRegion(nullptr);
+}
+
+/**
+ * Releases everything allocated since the matching push
+ */
+extern "C" void eva_region_pop()
+{
+    auto region = current;
+
+    if (region == nullptr || region->parent == nullptr || region->owner != nullptr)
+    {
+        std::fprintf(stderr, "Fatal Error: region stack underflow.\n");
+        std::exit(EXIT_FAILURE);
+    }
+
+    current = region->parent;
+
+    // The region's own header goes last, with its first chunk
+    releaseChunks(region->adopted.load(std::memory_order_acquire));
+    releaseChunks(region->chunks);
+}
+
+/**
+ * The calling thread's innermost region, for parallel-for workers
+ */
+extern "C" void *eva_region_current()
+{
+    return currentRegion();
+}
+
+/**
+ * Starts a worker region whose memory belongs to `owner`, a region of
+ * another thread (or of this one, for chunks the caller runs itself)
+ */
+extern "C" void eva_region_enter(void *owner)
+{
+    pushRegion((Region *)owner);
+}
+
+/**
+ * Ends the worker region, handing its chunks over to the owner
+ */
+extern "C" void eva_region_leave()
+{
+    auto region = current;
+
+    if (region == nullptr || region->owner == nullptr)
+    {
+        std::fprintf(stderr, "Fatal Error: region stack underflow.\n");
+        std::exit(EXIT_FAILURE);
+    }
+
+    current = region->parent;
+
+    // Nested worker regions were handed to this one
+    auto first = region->chunks;
+    auto last = first;
+
+    while (last->next != nullptr)
+    {
+        last = last->next;
+    }
+
+    last->next = region->adopted.load(std::memory_order_acquire);
+
+    while (last->next != nullptr)
+    {
+        last = last->next;
+    }
+
+    auto &adopted = region->owner->adopted;
+    last->next = adopted.load(std::memory_order_relaxed);
+
+    while (!adopted.compare_exchange_weak(last->next, first, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+}
+
+/**
+ * 16-byte aligned memory from the innermost region
+ */
+extern "C" void *eva_region_alloc(int64_t size)
+{
+    auto rounded = ((size_t)size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    auto region = currentRegion();
+
+    if (rounded > (size_t)(region->limit - region->cursor))
+    {
+        // Big blocks get a chunk of their own, the current one stays in use
+        if (rounded > CHUNK_SIZE / 4)
+        {
+            auto chunk = newChunk(rounded + sizeof(Chunk));
+            chunk->next = region->chunks->next;
+            region->chunks->next = chunk;
+            return chunk + 1;
+        }
+
+        auto chunk = newChunk(CHUNK_SIZE);
+        chunk->next = region->chunks;
+        region->chunks = chunk;
+        region->cursor = (char *)(chunk + 1);
+        region->limit = (char *)chunk + CHUNK_SIZE;
+    }
+
+    auto memory = region->cursor;
+    region->cursor += rounded;
+
+    return memory;
+}
@@ -0,0 +1,359 @@
+/**
+ * Eva runtime: string builtins
+ *
+ * str-len, str-eq & str-find run on SIMD kernels, picked once by CPU
+ * feature detection: AVX2 (32 bytes per step), SSE2 (16 bytes, always
+ * present on x86-64), or plain scalar code on other targets.
+ *
+ * New strings (str-concat, str-split) are allocated in the current region.
+ */
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+extern "C" void *eva_region_alloc(int64_t size);
+
+namespace
+{
+    struct StringKernels
+    {
+        size_t (*length)(const char *s);
+
+        bool (*equal)(const char *a, const char *b, size_t n);
+
+        // Index of the first occurrence, or -1
+        int64_t (*find)(const char *haystack, size_t n, const char *needle, size_t m);
+    };
+
+    /**
+     * Scalar versions, also used for the tails of SIMD loops
+     */
+    int64_t findScalar(const char *haystack, size_t n, const char *needle, size_t m, size_t from)
+    {
+        for (size_t i = from; i + m <= n; i++)
+        {
+            if (haystack[i] == needle[0] && std::memcmp(haystack + i, needle, m) == 0)
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+#if !defined(__x86_64__)
+
+    size_t lengthScalar(const char *s)
+    {
+        return std::strlen(s);
+    }
+
+    bool equalScalar(const char *a, const char *b, size_t n)
+    {
+        return std::memcmp(a, b, n) == 0;
+    }
+
+    int64_t findScalar(const char *haystack, size_t n, const char *needle, size_t m)
+    {
+        return findScalar(haystack, n, needle, m, 0);
+    }
+
+#else
+
+    /**
+     * Aligned loads never cross a page boundary, so reading a whole
+     * block around the terminator is safe.
+     */
+    size_t lengthSSE2(const char *s)
+    {
+        auto offset = (uintptr_t)s & 15;
+        auto block = (const __m128i *)(s - offset);
+        auto zero = _mm_setzero_si128();
+
+        // Bytes before the start don't count
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(block), zero)) >> offset;
+
+        if (mask != 0)
+        {
+            return __builtin_ctz(mask);
+        }
+
+        while (true)
+        {
+            block++;
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(block), zero));
+
+            if (mask != 0)
+            {
+                return (const char *)block - s + __builtin_ctz(mask);
+            }
+        }
+    }
+
+    bool equalSSE2(const char *a, const char *b, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            auto eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+
+            if (_mm_movemask_epi8(eq) != 0xFFFF)
+            {
+                return false;
+            }
+        }
+
+        return std::memcmp(a + i, b + i, n - i) == 0;
+    }
+
+    /**
+     * Compares the needle's first & last bytes against a whole block of
+     * candidate positions, and only verifies the positions where both match.
+     */
+    int64_t findSSE2(const char *haystack, size_t n, const char *needle, size_t m)
+    {
+        auto first = _mm_set1_epi8(needle[0]);
+        auto last = _mm_set1_epi8(needle[m - 1]);
+        size_t i = 0;
+
+        for (; i + m - 1 + 16 <= n; i += 16)
+        {
+            auto blockFirst = _mm_loadu_si128((const __m128i *)(haystack + i));
+            auto blockLast = _mm_loadu_si128((const __m128i *)(haystack + i + m - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+
+            while (mask != 0)
+            {
+                auto bit = __builtin_ctz(mask);
+
+                if (m <= 2 || std::memcmp(haystack + i + bit + 1, needle + 1, m - 2) == 0)
+                {
+                    return i + bit;
+                }
+
+                mask &= mask - 1;
+            }
+        }
+
+        return findScalar(haystack, n, needle, m, i);
+    }
+
+    __attribute__((target("avx2"))) size_t lengthAVX2(const char *s)
+    {
+        auto offset = (uintptr_t)s & 31;
+        auto block = (const __m256i *)(s - offset);
+        auto zero = _mm256_setzero_si256();
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(block), zero)) >> offset;
+
+        if (mask != 0)
+        {
+            return __builtin_ctz(mask);
+        }
+
+        while (true)
+        {
+            block++;
+            mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(block), zero));
+
+            if (mask != 0)
+            {
+                return (const char *)block - s + __builtin_ctz(mask);
+            }
+        }
+    }
+
+    __attribute__((target("avx2"))) bool equalAVX2(const char *a, const char *b, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 32 <= n; i += 32)
+        {
+            auto eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+
+            if ((uint32_t)_mm256_movemask_epi8(eq) != 0xFFFFFFFF)
+            {
+                return false;
+            }
+        }
+
+        return equalSSE2(a + i, b + i, n - i);
+    }
+
+    __attribute__((target("avx2"))) int64_t findAVX2(const char *haystack, size_t n, const char *needle, size_t m)
+    {
+        auto first = _mm256_set1_epi8(needle[0]);
+        auto last = _mm256_set1_epi8(needle[m - 1]);
+        size_t i = 0;
+
+        for (; i + m - 1 + 32 <= n; i += 32)
+        {
+            auto blockFirst = _mm256_loadu_si256((const __m256i *)(haystack + i));
+            auto blockLast = _mm256_loadu_si256((const __m256i *)(haystack + i + m - 1));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+
+            while (mask != 0)
+            {
+                auto bit = __builtin_ctz(mask);
+
+                if (m <= 2 || std::memcmp(haystack + i + bit + 1, needle + 1, m - 2) == 0)
+                {
+                    return i + bit;
+                }
+
+                mask &= mask - 1;
+            }
+        }
+
+        return findScalar(haystack, n, needle, m, i);
+    }
+
+    /**
+     * AVX2 needs both the CPU flag and the OS saving YMM registers
+     */
+    bool hasAVX2()
+    {
+        unsigned eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        {
+            return false;
+        }
+
+        unsigned xcr0Low, xcr0High;
+        __asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+
+        if ((xcr0Low & 6) != 6)
+        {
+            return false;
+        }
+
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+    }
+
+#endif
+
+    StringKernels detectKernels()
+    {
+#if defined(__x86_64__)
+        if (hasAVX2())
+        {
+            return {lengthAVX2, equalAVX2, findAVX2};
+        }
+
+        return {lengthSSE2, equalSSE2, findSSE2};
+#else
+        return {lengthScalar, equalScalar, findScalar};
+#endif
+    }
+
+    const StringKernels &kernels()
+    {
+        static const StringKernels selected = detectKernels();
+
+        return selected;
+    }
+
+    char *copyString(const char *s, size_t n)
+    {
+        auto copy = (char *)eva_region_alloc(n + 1);
+
+        std::memcpy(copy, s, n);
+        copy[n] = '\0';
+
+        return copy;
+    }
+}
+
+extern "C" int64_t eva_str_len(const char *s)
+{
+    return kernels().length(s);
+}
+
+extern "C" int32_t eva_str_eq(const char *a, const char *b)
+{
+    auto &k = kernels();
+    auto n = k.length(a);
+
+    return n == k.length(b) && k.equal(a, b, n);
+}
+
+extern "C" int64_t eva_str_find(const char *haystack, const char *needle)
+{
+    auto &k = kernels();
+    auto n = k.length(haystack);
+    auto m = k.length(needle);
+
+    if (m == 0)
+    {
+        return 0;
+    }
+
+    if (m > n)
+    {
+        return -1;
+    }
+
+    return k.find(haystack, n, needle, m);
+}
+
+extern "C" char *eva_str_concat(const char *a, const char *b)
+{
+    auto &k = kernels();
+    auto n = k.length(a);
+    auto m = k.length(b);
+    auto result = (char *)eva_region_alloc(n + m + 1);
+
+    std::memcpy(result, a, n);
+    std::memcpy(result + n, b, m + 1);
+
+    return result;
+}
+
+/**
+ * Parts between separators, followed by a null entry
+ */
+extern "C" char **eva_str_split(const char *s, const char *sep)
+{
+    auto &k = kernels();
+    auto n = k.length(s);
+    auto m = k.length(sep);
+
+    if (m == 0)
+    {
+        auto parts = (char **)eva_region_alloc(2 * sizeof(char *));
+        parts[0] = copyString(s, n);
+        parts[1] = nullptr;
+
+        return parts;
+    }
+
+    size_t count = 1;
+
+    for (auto at = k.find(s, n, sep, m); at >= 0; count++)
+    {
+        auto next = at + m;
+        auto rest = k.find(s + next, n - next, sep, m);
+        at = rest < 0 ? -1 : next + rest;
+    }
+
+    auto parts = (char **)eva_region_alloc((count + 1) * sizeof(char *));
+    size_t start = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto at = i + 1 < count ? start + k.find(s + start, n - start, sep, m) : n;
+        parts[i] = copyString(s + start, at - start);
+        start = at + m;
+    }
+
+    parts[count] = nullptr;
+
+    return parts;
+}
@@ -0,0 +1,154 @@
+#ifndef CompileStats_h
+#define CompileStats_h
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include "./Logger.h"
+
+/**
+ * Wall time of each compiler phase & size counters of one compilation,
+ * reported as JSON
+ */
+class CompileStats
+{
+public:
+    /**
+     * Adds the time until the end of its scope to a phase
+     */
+    class PhaseTimer
+    {
+    public:
+        PhaseTimer(CompileStats &stats, const std::string &phase)
+            : stats_(stats), phase_(phase), start_(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~PhaseTimer()
+        {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_;
+            stats_.addTime(phase_, elapsed.count());
+        }
+
+    private:
+        CompileStats &stats_;
+        std::string phase_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    PhaseTimer time(const std::string &phase)
+    {
+        return PhaseTimer(*this, phase);
+    }
+
+    void addTime(const std::string &phase, double ms)
+    {
+        find(phases_, phase) += ms;
+    }
+
+    void count(const std::string &counter, uint64_t value)
+    {
+        find(counters_, counter) = value;
+    }
+
+    // 0 if not recorded
+    double phaseMs(const std::string &phase) const
+    {
+        for (auto &entry : phases_)
+        {
+            if (entry.first == phase)
+            {
+                return entry.second;
+            }
+        }
+
+        return 0;
+    }
+
+    uint64_t counter(const std::string &counter) const
+    {
+        for (auto &entry : counters_)
+        {
+            if (entry.first == counter)
+            {
+                return entry.second;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Peak resident set size of the process so far
+     */
+    static uint64_t peakRSSKiB()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_maxrss;
+    }
+
+    /**
+     * {"phases": {"<phase>": ms, ...}, "totalMs": ms,
+     *  "counters": {"<counter>": n, ...}}
+     */
+    void writeJSON(const std::string &fileName)
+    {
+        std::ofstream out(fileName);
+
+        if (!out)
+        {
+            DIE << "can't write stats to " << fileName;
+        }
+
+        count("peakRSSKiB", peakRSSKiB());
+
+        auto total = 0.0;
+
+        out << "{\n  \"phases\": {";
+
+        for (auto i = 0; i < phases_.size(); i++)
+        {
+            out << (i == 0 ? "\n" : ",\n") << "    \"" << phases_[i].first << "\": " << phases_[i].second;
+            total += phases_[i].second;
+        }
+
+        out << "\n  },\n  \"totalMs\": " << total << ",\n  \"counters\": {";
+
+        for (auto i = 0; i < counters_.size(); i++)
+        {
+            out << (i == 0 ? "\n" : ",\n") << "    \"" << counters_[i].first << "\": " << counters_[i].second;
+        }
+
+        out << "\n  }\n}\n";
+    }
+
+private:
+    // Entries keep the order they were first recorded in
+    template <typename T>
+    static T &find(std::vector<std::pair<std::string, T>> &entries, const std::string &name)
+    {
+        for (auto &entry : entries)
+        {
+            if (entry.first == name)
+            {
+                return entry.second;
+            }
+        }
+
+        entries.push_back({name, T{}});
+
+        return entries.back().second;
+    }
+
+    std::vector<std::pair<std::string, double>> phases_;
+
+    std::vector<std::pair<std::string, uint64_t>> counters_;
+};
+
+#endif
@@ -27,6 +27,12 @@ public:
         return resolve(name)->record_[name];
     }
 
+    // Whether the variable is visible from this scope
+    bool isDefined(const std::string &name)
+    {
+        return record_.count(name) != 0 || (parent_ != nullptr && parent_->isDefined(name));
+    }
+
 private:
     // Traverse environment chain
     std::shared_ptr<Environment> resolve(const std::string &name)
@@ -0,0 +1,334 @@
+#ifndef EvaBuild_h
+#define EvaBuild_h
+
+#include <map>
+#include <set>
+#include "llvm/LTO/LTO.h"
+#include "llvm/Support/Caching.h"
+#include "llvm/Support/ThreadPool.h"
+#include "./EvaLLVM.h"
+
+/**
+ * Separate compilation & ThinLTO link of a program & its modules.
+ *
+ * Every file reachable through (import ...) from the entry file is compiled
+ * to <cacheDir>/<name>.bc, bitcode with a module summary. Files compile in
+ * parallel, and only when they or one of their imports changed (imports
+ * provide the declarations).
+ *
+ * The link step runs ThinLTO: the summaries decide which functions are
+ * imported across modules for inlining, then each module is optimized &
+ * code-generated on its own thread. Backend results of unchanged modules
+ * come from <cacheDir>/thinlto. The objects are linked with the runtime
+ * library (./libeva-runtime.a, or $EVA_RUNTIME_LIB) into an executable.
+ */
+class EvaBuild
+{
+public:
+    EvaBuild(EvaOptions options, std::string cacheDir = "./eva-cache")
+        : options_(options), cacheDir_(cacheDir)
+    {
+    }
+
+    void build(const std::string &entryFile, const std::string &executable)
+    {
+        if (auto error = llvm::sys::fs::create_directories(cacheDir_))
+        {
+            DIE << "can't create " << cacheDir_ << ": " << error.message();
+        }
+
+        findFiles(entryFile);
+
+        {
+            auto timer = stats_.time("compile");
+            compileChanged();
+        }
+
+        std::vector<std::string> objects;
+
+        {
+            auto timer = stats_.time("ThinLTO");
+            objects = thinLink();
+        }
+
+        {
+            auto timer = stats_.time("link");
+            linkExecutable(objects, executable);
+        }
+
+        if (!options_.statsFile.empty())
+        {
+            stats_.writeJSON(options_.statsFile);
+        }
+    }
+
+private:
+    /**
+     * The entry file & everything it imports, directly or not
+     */
+    void findFiles(const std::string &fileName)
+    {
+        if (imports_.count(fileName) != 0)
+        {
+            return;
+        }
+
+        auto &imports = imports_[fileName];
+
+        syntax::EvaParser parser;
+        auto ast = parser.parse("(begin " + EvaLLVM::readSourceFile(fileName) + ")");
+
+        // Imports are top-level forms, of the file or of its module
+        auto moduleExp = EvaLLVM::findModule(ast);
+        auto &forms = moduleExp != nullptr ? moduleExp->list : ast.list;
+
+        for (auto &form : forms)
+        {
+            if (form.type == ExpType::LIST && form.list.size() == 2 && form.list[0].string == "import")
+            {
+                imports.push_back(EvaLLVM::importPath(fileName, form.list[1].string));
+            }
+        }
+
+        auto name = llvm::sys::path::stem(fileName).str();
+
+        if (!names_.insert(name).second)
+        {
+            DIE << "build: more than one file is named " << name;
+        }
+
+        bitcodeFiles_[fileName] = cacheDir_ + "/" + name + ".bc";
+
+        for (auto import : imports)
+        {
+            findFiles(import);
+        }
+    }
+
+    /**
+     * Stale: the bitcode is missing or older than the file or its imports
+     */
+    bool isStale(const std::string &fileName)
+    {
+        llvm::sys::fs::file_status bitcode;
+
+        if (llvm::sys::fs::status(bitcodeFiles_[fileName], bitcode) || !llvm::sys::fs::exists(bitcode))
+        {
+            return true;
+        }
+
+        auto sources = imports_[fileName];
+        sources.push_back(fileName);
+
+        for (auto &source : sources)
+        {
+            llvm::sys::fs::file_status status;
+
+            if (llvm::sys::fs::status(source, status) || status.getLastModificationTime() > bitcode.getLastModificationTime())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void compileChanged()
+    {
+        llvm::ThreadPool pool(llvm::heavyweight_hardware_concurrency());
+        uint64_t compiled = 0;
+
+        for (auto &entry : bitcodeFiles_)
+        {
+            if (!isStale(entry.first))
+            {
+                continue;
+            }
+
+            compiled++;
+
+            auto options = options_;
+            options.printIR = false;
+            options.outputFile = "";
+            options.objectFile = "";
+            options.statsFile = "";
+            options.sourceFile = entry.first;
+            options.bitcodeFile = entry.second;
+
+            pool.async([options]
+                       {
+                EvaLLVM vm(options);
+                vm.exec(EvaLLVM::readSourceFile(options.sourceFile)); });
+        }
+
+        pool.wait();
+
+        stats_.count("modules", bitcodeFiles_.size());
+        stats_.count("compiledModules", compiled);
+    }
+
+    /**
+     * Object files, one per module
+     */
+    std::vector<std::string> thinLink()
+    {
+        auto target = EvaLLVM::resolveTarget(options_);
+
+        llvm::lto::Config config;
+        config.DefaultTriple = target.triple;
+        config.CPU = target.cpu;
+        config.MAttrs = llvm::SubtargetFeatures(target.features).getFeatures();
+        config.RelocModel = llvm::Reloc::PIC_;
+        config.OptLevel = std::min(options_.optLevel, 3);
+        config.CGOptLevel = EvaLLVM::codeGenOptLevel(options_.optLevel);
+
+        llvm::lto::LTO lto(std::move(config), llvm::lto::createInProcessThinBackend(llvm::heavyweight_hardware_concurrency()));
+
+        // Inputs refer to the buffers until the link is done
+        std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+        std::map<std::string, std::string> definedIn;
+
+        for (auto &entry : bitcodeFiles_)
+        {
+            auto buffer = llvm::MemoryBuffer::getFile(entry.second);
+
+            if (!buffer)
+            {
+                DIE << "can't read " << entry.second << ": " << buffer.getError().message();
+            }
+
+            buffers.push_back(std::move(*buffer));
+
+            auto input = check(llvm::lto::InputFile::create(buffers.back()->getMemBufferRef()));
+            std::vector<llvm::lto::SymbolResolution> resolutions;
+
+            for (auto &symbol : input->symbols())
+            {
+                llvm::lto::SymbolResolution resolution;
+
+                if (!symbol.isUndefined())
+                {
+                    auto inserted = definedIn.insert({symbol.getName().str(), entry.first});
+
+                    if (!inserted.second)
+                    {
+                        DIE << "build: " << symbol.getName().str() << " is defined in " << inserted.first->second << " & " << entry.first;
+                    }
+
+                    resolution.Prevailing = true;
+                    resolution.FinalDefinitionInLinkageUnit = true;
+                }
+
+                // Only main is called from outside Eva code, everything
+                // else may be internalized
+                resolution.VisibleToRegularObj = symbol.getName() == "main";
+                resolutions.push_back(resolution);
+            }
+
+            check(lto.add(std::move(input), resolutions));
+        }
+
+        std::vector<std::string> objects(lto.getMaxTasks());
+
+        auto objectFile = [&](unsigned task)
+        {
+            return objects[task] = cacheDir_ + "/out." + std::to_string(task) + ".o";
+        };
+
+        // Cached backend results, & fresh ones once they're in the cache
+        auto addBuffer = [&](unsigned task, std::unique_ptr<llvm::MemoryBuffer> buffer)
+        {
+            std::error_code errorCode;
+            llvm::raw_fd_ostream out(objectFile(task), errorCode, llvm::sys::fs::OF_None);
+
+            if (errorCode)
+            {
+                DIE << "can't write " << objects[task] << ": " << errorCode.message();
+            }
+
+            out << buffer->getBuffer();
+        };
+
+        auto cache = check(llvm::localCache("ThinLTO", "Thin", cacheDir_ + "/thinlto", addBuffer));
+
+        // Uncached output (the regular LTO partition)
+        auto addStream = [&](unsigned task) -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>>
+        {
+            std::error_code errorCode;
+            auto out = std::make_unique<llvm::raw_fd_ostream>(objectFile(task), errorCode, llvm::sys::fs::OF_None);
+
+            if (errorCode)
+            {
+                return llvm::errorCodeToError(errorCode);
+            }
+
+            return std::make_unique<llvm::CachedFileStream>(std::move(out));
+        };
+
+        check(lto.run(addStream, cache));
+
+        std::vector<std::string> written;
+
+        for (auto &object : objects)
+        {
+            if (!object.empty())
+            {
+                written.push_back(object);
+            }
+        }
+
+        return written;
+    }
+
+    void linkExecutable(const std::vector<std::string> &objects, const std::string &executable)
+    {
+        auto runtimeLib = std::getenv("EVA_RUNTIME_LIB") != nullptr ? std::getenv("EVA_RUNTIME_LIB") : "./libeva-runtime.a";
+        auto linkCommand = "c++ -o " + executable;
+
+        for (auto &object : objects)
+        {
+            linkCommand += " " + object;
+        }
+
+        linkCommand += std::string(" ") + runtimeLib + " -pthread";
+
+        if (std::system(linkCommand.c_str()) != 0)
+        {
+            DIE << "linking failed: " << linkCommand;
+        }
+    }
+
+    static void check(llvm::Error error)
+    {
+        if (error)
+        {
+            DIE << "ThinLTO: " << llvm::toString(std::move(error));
+        }
+    }
+
+    template <typename T>
+    static T check(llvm::Expected<T> value)
+    {
+        if (!value)
+        {
+            DIE << "ThinLTO: " << llvm::toString(value.takeError());
+        }
+
+        return std::move(*value);
+    }
+
+    EvaOptions options_;
+
+    std::string cacheDir_;
+
+    // Source file -> imported files / its bitcode
+    std::map<std::string, std::vector<std::string>> imports_;
+    std::map<std::string, std::string> bitcodeFiles_;
+
+    // Bitcode is named after the source file
+    std::set<std::string> names_;
+
+    CompileStats stats_;
+};
+
+#endif
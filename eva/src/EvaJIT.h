@@ -0,0 +1,274 @@
+#ifndef EvaJIT_h
+#define EvaJIT_h
+
+#include <cstdio>
+#include <unistd.h>
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "./Logger.h"
+
+/**
+ * Which tools get to see JIT'ed code
+ */
+struct EvaJITOptions
+{
+    // Register objects (with their DWARF, see -g) with gdb's JIT interface
+    bool gdb = false;
+
+    // Function symbols go to /tmp/perf-<pid>.map (perf report), and code
+    // & line tables to a jitdump in $JITDUMPDIR or ~/.debug/jit (perf inject --jit)
+    bool perf = false;
+
+    // Compile each function to machine code on its first call, behind a
+    // call-through stub, instead of the whole module before main runs
+    bool lazy = false;
+};
+
+/**
+ * Appends "<start> <size> <name>" per JIT'ed function to /tmp/perf-<pid>.map,
+ * where perf looks up symbols of anonymous executable memory
+ */
+class PerfMapListener : public llvm::JITEventListener
+{
+public:
+    PerfMapListener()
+    {
+        auto fileName = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        file_ = std::fopen(fileName.c_str(), "a");
+
+        if (file_ == nullptr)
+        {
+            DIE << "can't write " << fileName;
+        }
+    }
+
+    ~PerfMapListener()
+    {
+        std::fclose(file_);
+    }
+
+    void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile &object,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &loadedInfo) override
+    {
+        // Symbol addresses of the debug object are the loaded ones
+        auto debugObject = loadedInfo.getObjectForDebug(object);
+        auto &loaded = debugObject.getBinary() != nullptr ? *debugObject.getBinary() : object;
+
+        for (auto &[symbol, size] : llvm::object::computeSymbolSizes(loaded))
+        {
+            auto type = symbol.getType();
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+
+            if (!type || *type != llvm::object::SymbolRef::ST_Function || !name || !address || size == 0)
+            {
+                llvm::consumeError(type.takeError());
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(address.takeError());
+                continue;
+            }
+
+            std::fprintf(file_, "%lx %lx %s\n", (unsigned long)*address, (unsigned long)size, name->str().c_str());
+        }
+
+        std::fflush(file_);
+    }
+
+private:
+    std::FILE *file_;
+};
+
+/**
+ * Runs compiled Eva modules in-process (ORC LLJIT).
+ *
+ * Symbols the module doesn't define (libc, or the Eva runtime when it's
+ * not linked in as bitcode) are looked up in the host process.
+ *
+ * Objects are linked by RuntimeDyld, so the gdb & perf event listeners
+ * can be attached.
+ *
+ * Lazy mode (LLLazyJIT) splits modules per function in the
+ * CompileOnDemandLayer: functions that are never called are never
+ * code-generated. Eva -> IR & in-process -O<n> still run on the whole
+ * module beforehand.
+ */
+class EvaJIT
+{
+public:
+    EvaJIT(EvaJITOptions options = {})
+    {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+
+        if (options.gdb)
+        {
+            listeners_.push_back(llvm::JITEventListener::createGDBRegistrationListener());
+        }
+
+        if (options.perf)
+        {
+            perfMap_ = std::make_unique<PerfMapListener>();
+            listeners_.push_back(perfMap_.get());
+
+            // nullptr if LLVM is built without perf support
+            if (auto jitDump = llvm::JITEventListener::createPerfJITEventListener())
+            {
+                listeners_.push_back(jitDump);
+            }
+        }
+
+        lazy_ = options.lazy;
+
+        if (lazy_)
+        {
+            llvm::orc::LLLazyJITBuilder builder;
+            jit_ = create(builder);
+        }
+        else
+        {
+            llvm::orc::LLJITBuilder builder;
+            jit_ = create(builder);
+        }
+
+        auto &mainDylib = jit_->getMainJITDylib();
+        mainDylib.addGenerator(check(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            jit_->getDataLayout().getGlobalPrefix())));
+    }
+
+    void addModule(llvm::orc::ThreadSafeModule module)
+    {
+        // Code is generated for the host: the module must have been
+        // compiled for it (no --target of another machine)
+        module.withModuleDo([&](llvm::Module &m)
+                            {
+            llvm::Triple triple(m.getTargetTriple());
+            auto &host = jit_->getTargetTriple();
+
+            if (!m.getTargetTriple().empty() && (triple.getArch() != host.getArch() || triple.getOS() != host.getOS()))
+            {
+                DIE << "JIT: the module targets " << triple.str() << ", but runs on " << host.str() << " (drop --target with --jit)";
+            }
+
+            if (m.getDataLayout().isDefault())
+            {
+                m.setDataLayout(jit_->getDataLayout());
+            }
+            else if (m.getDataLayout() != jit_->getDataLayout())
+            {
+                DIE << "JIT: the module's data layout " << m.getDataLayoutStr()
+                    << " doesn't match the host's " << jit_->getDataLayout().getStringRepresentation();
+            } });
+
+        if (lazy_)
+        {
+            check(static_cast<llvm::orc::LLLazyJIT &>(*jit_).addLazyIRModule(std::move(module)));
+        }
+        else
+        {
+            check(jit_->addIRModule(std::move(module)));
+        }
+    }
+
+    /**
+     * Exported by the host process, e.g. the Eva runtime of a binary
+     * linked with it & -rdynamic
+     */
+    static bool hostDefines(const std::string &name)
+    {
+        llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+        return llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name) != nullptr;
+    }
+
+    /**
+     * Address of a JIT'ed symbol, nullptr if there's none
+     */
+    void *lookup(const std::string &name)
+    {
+        auto symbol = jit_->lookup(name);
+
+        if (!symbol)
+        {
+            llvm::consumeError(symbol.takeError());
+            return nullptr;
+        }
+
+        return (void *)symbol->getAddress();
+    }
+
+    /**
+     * Runs static constructors, main() & static destructors
+     */
+    int runMain()
+    {
+        check(jit_->initialize(jit_->getMainJITDylib()));
+
+        // Reports what's missing, e.g. symbols of the runtime
+        auto main = (int (*)())check(jit_->lookup("main")).getAddress();
+
+        auto result = main();
+
+        check(jit_->deinitialize(jit_->getMainJITDylib()));
+
+        return result;
+    }
+
+private:
+    /**
+     * LLJIT or LLLazyJIT, linking objects with the listeners attached
+     */
+    template <typename Builder>
+    std::unique_ptr<llvm::orc::LLJIT> create(Builder &builder)
+    {
+        builder.setObjectLinkingLayerCreator([&](llvm::orc::ExecutionSession &session, const llvm::Triple &)
+                                             {
+            auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                session, []
+                { return std::make_unique<llvm::SectionMemoryManager>(); });
+
+            for (auto listener : listeners_)
+            {
+                layer->registerJITEventListener(*listener);
+            }
+
+            return std::unique_ptr<llvm::orc::ObjectLayer>(std::move(layer)); });
+
+        return check(builder.create());
+    }
+
+    static void check(llvm::Error error)
+    {
+        if (error)
+        {
+            DIE << "JIT: " << llvm::toString(std::move(error));
+        }
+    }
+
+    template <typename T>
+    static T check(llvm::Expected<T> value)
+    {
+        if (!value)
+        {
+            DIE << "JIT: " << llvm::toString(value.takeError());
+        }
+
+        return std::move(*value);
+    }
+
+    // Outlive the JIT, which notifies them when objects are freed
+    std::unique_ptr<PerfMapListener> perfMap_;
+
+    std::vector<llvm::JITEventListener *> listeners_;
+
+    bool lazy_;
+
+    std::unique_ptr<llvm::orc::LLJIT> jit_;
+};
+
+#endif
@@ -3,16 +3,45 @@
 
 #include <string>
 #include <regex>
+#include <list>
+#include <mutex>
+#include <set>
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "./parser/EvaParser.h"
 #include "./Environment.h"
+#include "./CompileStats.h"
 
 using syntax::EvaParser;
 using Env = std::shared_ptr<Environment>;
 
+// Values flowing into a phi, with their incoming blocks
+using BranchResults = std::vector<std::pair<llvm::Value *, llvm::BasicBlock *>>;
+
 #define GEN_BINARY_OP(Op, varName)             \
     do                                         \
     {                                          \
@@ -22,12 +51,193 @@ using Env = std::shared_ptr<Environment>;
         return builder->Op(op1, op2, varName); \
     } while (false) // Not executed, but generates scope
 
+// Integer or floating point instruction, depending on the operands.
+// Works element-wise on vectors; a scalar operand is splatted.
+#define GEN_NUMERIC_OP(IntOp, FloatOp, varName)         \
+    do                                                  \
+    {                                                   \
+        auto op1 = generate(exp.list[1], env);          \
+        auto op2 = generate(exp.list[2], env);          \
+                                                        \
+        coerceOperands(op1, op2);                       \
+                                                        \
+        if (op1->getType()->isFPOrFPVectorTy())         \
+        {                                               \
+            return builder->FloatOp(op1, op2, varName); \
+        }                                               \
+                                                        \
+        return builder->IntOp(op1, op2, varName);       \
+    } while (false)
+
+// Integer arithmetic is nsw: Eva numbers are signed & don't wrap.
+// With checked arithmetic, overflow traps instead.
+#define GEN_ARITH_OP(IntOp, FloatOp, CheckedId, varName)                             \
+    do                                                                               \
+    {                                                                                \
+        auto op1 = generate(exp.list[1], env);                                       \
+        auto op2 = generate(exp.list[2], env);                                       \
+                                                                                     \
+        coerceOperands(op1, op2);                                                    \
+                                                                                     \
+        if (op1->getType()->isFPOrFPVectorTy())                                      \
+        {                                                                            \
+            return builder->FloatOp(op1, op2, varName);                              \
+        }                                                                            \
+                                                                                     \
+        if (options.checkedArithmetic && !op1->getType()->isVectorTy())              \
+        {                                                                            \
+            return createCheckedOp(CheckedId, op1, op2, varName);                    \
+        }                                                                            \
+                                                                                     \
+        return builder->IntOp(op1, op2, varName, /* NUW */ false, /* NSW */ true);   \
+    } while (false)
+
+/**
+ * Compiler settings, chosen by the driver
+ */
+struct EvaOptions
+{
+    // Trap on signed overflow & invalid division (debug builds)
+    bool checkedArithmetic = false;
+
+    // In-process optimization: 0 (none) - 3
+    int optLevel = 0;
+
+    // Phase timings & counters are written here as JSON, if set
+    std::string statsFile;
+
+    // Generated IR goes to stdout & this file (none if empty)
+    bool printIR = true;
+    std::string outputFile = "./out.ll";
+
+    // Native object file for the host, if set
+    std::string objectFile;
+
+    // Count calls & loop iterations, time functions; printed at exit
+    bool instrument = false;
+
+    // IR-level PGO: instrumented build writing this .profraw file
+    // (%p, %m patterns allowed), or a build using merged .profdata.
+    // Both optimize at -O2 unless a level is given.
+    std::string pgoGenerate;
+    std::string pgoUse;
+
+    // DWARF line tables & subprograms, so perf, gdb & addr2line show
+    // Eva source lines. firstLine: line of the program in sourceFile.
+    bool debugInfo = false;
+    std::string sourceFile = "main.eva";
+    int firstLine = 1;
+
+    // Code generation target: triple & CPU, the host's if empty.
+    // Functions are tuned for the CPU & may use all of its features.
+    std::string targetTriple;
+    std::string targetCPU;
+
+    // Separate compilation (EvaBuild): bitcode with a ThinLTO summary.
+    // The runtime isn't linked in; it's linked once into the executable.
+    std::string bitcodeFile;
+};
+
+/**
+ * What code is generated for, resolved from EvaOptions
+ */
+struct TargetSpec
+{
+    std::string triple;
+    std::string cpu;
+    std::string features;
+};
+
+/**
+ * Profile counters of one function or loop (--instrument)
+ */
+struct ProfileProbe
+{
+    std::string name;
+    bool isLoop;
+
+    // Calls or iterations
+    llvm::GlobalVariable *count;
+
+    // Cycles including & excluding callees
+    llvm::GlobalVariable *cycles;
+    llvm::GlobalVariable *selfCycles;
+};
+
+/**
+ * Cycle counter & callee cycles at function entry
+ */
+struct ProfileScope
+{
+    ProfileProbe *probe = nullptr;
+    llvm::Value *start = nullptr;
+    llvm::Value *outerCalleeCycles = nullptr;
+};
+
+/**
+ * Struct type & its field names, in declaration order
+ */
+struct StructLayout
+{
+    llvm::StructType *type;
+    std::vector<std::string> fields;
+
+    // Arrays of this struct use structure-of-arrays layout
+    bool soa = false;
+};
+
+/**
+ * Current coroutine: its handle & promise, and the shared
+ * destroy (cleanup) & return-to-caller (suspend) blocks
+ */
+struct CoroState
+{
+    llvm::Value *handle = nullptr;
+    llvm::Value *promise = nullptr;
+    llvm::BasicBlock *cleanupBlock = nullptr;
+    llvm::BasicBlock *suspendBlock = nullptr;
+};
+
+/**
+ * Forms lowered to a single llvm.* intrinsic.
+ * Integer & floating point operands may map to different intrinsics;
+ * not_intrinsic marks an unsupported kind.
+ */
+struct IntrinsicBuiltin
+{
+    llvm::Intrinsic::ID intId;
+    llvm::Intrinsic::ID fpId;
+    size_t arity;
+};
+
+static const std::map<std::string, IntrinsicBuiltin> intrinsicBuiltins = {
+    {"popcount", {llvm::Intrinsic::ctpop, llvm::Intrinsic::not_intrinsic, 1}},
+    {"ctlz", {llvm::Intrinsic::ctlz, llvm::Intrinsic::not_intrinsic, 1}},
+    {"cttz", {llvm::Intrinsic::cttz, llvm::Intrinsic::not_intrinsic, 1}},
+    {"bswap", {llvm::Intrinsic::bswap, llvm::Intrinsic::not_intrinsic, 1}},
+    {"abs", {llvm::Intrinsic::abs, llvm::Intrinsic::fabs, 1}},
+    {"sqrt", {llvm::Intrinsic::not_intrinsic, llvm::Intrinsic::sqrt, 1}},
+    {"floor", {llvm::Intrinsic::not_intrinsic, llvm::Intrinsic::floor, 1}},
+    {"ceil", {llvm::Intrinsic::not_intrinsic, llvm::Intrinsic::ceil, 1}},
+    {"fma", {llvm::Intrinsic::not_intrinsic, llvm::Intrinsic::fma, 3}},
+    {"min", {llvm::Intrinsic::smin, llvm::Intrinsic::minnum, 2}},
+    {"max", {llvm::Intrinsic::smax, llvm::Intrinsic::maxnum, 2}},
+    {"expect", {llvm::Intrinsic::expect, llvm::Intrinsic::not_intrinsic, 2}},
+    {"prefetch", {llvm::Intrinsic::prefetch, llvm::Intrinsic::not_intrinsic, 1}},
+};
+
 class EvaLLVM
 {
 public:
-    EvaLLVM()
-        : parser(std::make_unique<EvaParser>())
+    EvaLLVM(EvaOptions options = {})
+        : options(options), parser(std::make_unique<EvaParser>())
     {
+        // PGO passes are part of the optimization pipeline
+        if ((!options.pgoGenerate.empty() || !options.pgoUse.empty()) && options.optLevel == 0)
+        {
+            this->options.optLevel = 2;
+        }
+
         moduleInit();
         setupExternalFunctions();
         setupGlobalEnvironment();
@@ -35,13 +245,200 @@ public:
 
     void exec(const std::string &program)
     {
-        auto ast = parser->parse("(begin " + program + ")");
+        auto source = "(begin " + program + ")";
+
+        // The parser lexes on demand; a separate pass only for the report
+        if (!options.statsFile.empty())
+        {
+            auto timer = stats.time("Tokenizer");
+            stats.count("tokens", countTokens(source));
+        }
+
+        auto ast = parse(source);
+        stats.count("astNodes", countNodes(ast));
+
+        {
+            auto timer = stats.time("EvaLLVM::generate");
+            compile(ast);
+            setTargetAttributes();
+
+            if (diBuilder)
+            {
+                diBuilder->finalize();
+            }
+        }
+
+        countIR("");
+
+        // Before optimization, so runtime helpers can be inlined. Separately
+        // compiled modules share the runtime's state, so it's linked once.
+        if (options.bitcodeFile.empty())
+        {
+            auto timer = stats.time("link");
+            linkRuntime(runtimeBitcode);
+        }
+
+        {
+            auto timer = stats.time("verify");
+
+            if (llvm::verifyModule(*module, &llvm::errs()))
+            {
+                DIE << "generated module is invalid";
+            }
+        }
+
+        // Coroutines must be split even at -O0
+        if (options.optLevel > 0 || hasCoroutines())
+        {
+            auto timer = stats.time("optimize");
+            optimize();
+        }
+
+        if (options.optLevel > 0)
+        {
+            countIR("optimized");
+        }
+
+        {
+            auto timer = stats.time("emit");
+
+            if (options.printIR)
+            {
+                module->print(llvm::outs(), nullptr);
+            }
+
+            if (!options.outputFile.empty())
+            {
+                saveModuleToFile(options.outputFile);
+            }
+
+            if (!options.objectFile.empty())
+            {
+                emitObjectFile(options.objectFile);
+            }
+
+            if (!options.bitcodeFile.empty())
+            {
+                emitBitcodeFile(options.bitcodeFile);
+            }
+        }
+
+        if (!options.statsFile.empty())
+        {
+            stats.writeJSON(options.statsFile);
+        }
+    }
+
+    const CompileStats &getStats() const
+    {
+        return stats;
+    }
+
+    /**
+     * Eva runtime as bitcode (build-runtime.sh), linked into every
+     * program when it exists
+     */
+    static constexpr const char *runtimeBitcode = "./eva-runtime.bc";
+
+    /**
+     * Hands the compiled module (& its context) over, e.g. to the JIT.
+     * Nothing can be compiled afterwards.
+     */
+    llvm::orc::ThreadSafeModule takeModule()
+    {
+        return llvm::orc::ThreadSafeModule(std::move(module), std::move(ctx));
+    }
+
+    /**
+     * Triple: the host's or options.targetTriple.
+     * CPU: options.targetCPU, or the host CPU with its detected features,
+     * which also cover features the name doesn't imply (e.g. AVX disabled
+     * by the OS).
+     */
+    static TargetSpec resolveTarget(const EvaOptions &options)
+    {
+        // Compilations may run in parallel (EvaBuild)
+        static std::once_flag targetsInitialized;
+
+        std::call_once(targetsInitialized, []
+                       {
+            llvm::InitializeAllTargetInfos();
+            llvm::InitializeAllTargets();
+            llvm::InitializeAllTargetMCs();
+            llvm::InitializeAllAsmPrinters(); });
+
+        auto host = options.targetTriple.empty();
+
+        TargetSpec spec;
+        spec.triple = host ? llvm::sys::getDefaultTargetTriple() : llvm::Triple::normalize(options.targetTriple);
+        spec.cpu = options.targetCPU;
+
+        if (spec.cpu.empty() || spec.cpu == "native")
+        {
+            spec.cpu = host ? llvm::sys::getHostCPUName().str() : "generic";
+
+            llvm::StringMap<bool> hostFeatures;
+
+            if (host && llvm::sys::getHostCPUFeatures(hostFeatures))
+            {
+                llvm::SubtargetFeatures featureList;
+
+                for (auto &feature : hostFeatures)
+                {
+                    featureList.AddFeature(feature.getKey(), feature.getValue());
+                }
+
+                spec.features = featureList.getString();
+            }
+        }
+
+        return spec;
+    }
+
+    static llvm::CodeGenOpt::Level codeGenOptLevel(int optLevel)
+    {
+        static const llvm::CodeGenOpt::Level levels[] = {
+            llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+            llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+
+        return levels[std::min(optLevel, 3)];
+    }
+
+    static std::string readSourceFile(const std::string &fileName)
+    {
+        auto buffer = llvm::MemoryBuffer::getFile(fileName);
+
+        if (!buffer)
+        {
+            DIE << "can't read " << fileName << ": " << buffer.getError().message();
+        }
+
+        return (*buffer)->getBuffer().str();
+    }
+
+    /**
+     * (import "lib/math.eva") is relative to the importing file
+     */
+    static std::string importPath(const std::string &fromFile, const std::string &file)
+    {
+        llvm::SmallString<128> path(llvm::sys::path::parent_path(fromFile));
+        llvm::sys::path::append(path, file);
 
-        compile(ast);
+        return path.str().str();
+    }
 
-        module->print(llvm::outs(), nullptr);
+    /**
+     * (module name ...) if it's the only form of a file's AST
+     */
+    static const Exp *findModule(const Exp &ast)
+    {
+        if (ast.list.size() == 2 && ast.list[1].type == ExpType::LIST && !ast.list[1].list.empty() &&
+            ast.list[1].list[0].type == ExpType::SYMBOL && ast.list[1].list[0].string == "module")
+        {
+            return &ast.list[1];
+        }
 
-        saveModuleToFile("./out.ll");
+        return nullptr;
     }
 
 private:
@@ -51,8 +448,83 @@ private:
         module = std::make_unique<llvm::Module>("EvaLLVM", *ctx);
         builder = std::make_unique<llvm::IRBuilder<>>(*ctx);
         varsBuilder = std::make_unique<llvm::IRBuilder<>>(*ctx);
+
+        targetInit();
+
+        if (options.debugInfo)
+        {
+            debugInfoInit();
+        }
+    }
+
+    /**
+     * Target machine for the triple & CPU; the module gets its triple &
+     * data layout, so the optimizer knows type sizes, vector widths etc.
+     */
+    void targetInit()
+    {
+        auto spec = resolveTarget(options);
+
+        std::string error;
+        auto target = llvm::TargetRegistry::lookupTarget(spec.triple, error);
+
+        if (target == nullptr)
+        {
+            DIE << error;
+        }
+
+        targetMachine.reset(target->createTargetMachine(spec.triple, spec.cpu, spec.features, llvm::TargetOptions(), llvm::Reloc::PIC_,
+                                                        llvm::None, codeGenOptLevel(options.optLevel)));
+
+        module->setTargetTriple(spec.triple);
+        module->setDataLayout(targetMachine->createDataLayout());
+    }
+
+    /**
+     * target-cpu & target-features on every defined function: the backend
+     * & TargetTransformInfo read them per function (the JIT too)
+     */
+    void setTargetAttributes()
+    {
+        auto cpu = targetMachine->getTargetCPU();
+        auto features = targetMachine->getTargetFeatureString();
+
+        for (auto &function : module->functions())
+        {
+            if (function.isDeclaration())
+            {
+                continue;
+            }
+
+            function.addFnAttr("target-cpu", cpu);
+
+            if (!features.empty())
+            {
+                function.addFnAttr("target-features", features);
+            }
+        }
+    }
+
+    /**
+     * One compile unit for the program; C is the closest DWARF language
+     */
+    void debugInfoInit()
+    {
+        diBuilder = std::make_unique<llvm::DIBuilder>(*module);
+
+        auto path = llvm::StringRef(options.sourceFile);
+        debugFile = diBuilder->createFile(llvm::sys::path::filename(path), llvm::sys::path::parent_path(path));
+        diBuilder->createCompileUnit(llvm::dwarf::DW_LANG_C, debugFile, "eva-llvm", options.optLevel > 0, "", 0);
+
+        module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+        module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
     }
 
+    /**
+     * Compiler settings
+     */
+    EvaOptions options;
+
     std::unique_ptr<EvaParser> parser;
 
     Env GlobalEnv;
@@ -79,56 +551,486 @@ private:
     {
         auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
 
-        module->getOrInsertFunction("printf",
+        // Eva runtime (runtime/IO.cpp): buffered output
+        module->getOrInsertFunction("eva_printf",
                                     llvm::FunctionType::get(/* return type */ builder->getInt32Ty(), /* format arg */ bytePtrTy, /* vararg */ true));
+
+        module->getOrInsertFunction("eva_print_int",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), builder->getInt64Ty(), false));
+
+        module->getOrInsertFunction("eva_print_f64",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), builder->getDoubleTy(), false));
+
+        module->getOrInsertFunction("eva_print_char",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), builder->getInt32Ty(), false));
+
+        module->getOrInsertFunction("eva_print_str",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), bytePtrTy, false));
+
+        module->getOrInsertFunction("eva_print_strn",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), {bytePtrTy, builder->getInt64Ty()}, false));
+
+        module->getOrInsertFunction("eva_flush",
+                                    llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        module->getOrInsertFunction("malloc",
+                                    llvm::FunctionType::get(/* return type */ bytePtrTy, /* size arg */ builder->getInt64Ty(), /* vararg */ false));
+
+        module->getOrInsertFunction("free",
+                                    llvm::FunctionType::get(/* return type */ builder->getVoidTy(), /* ptr arg */ bytePtrTy, /* vararg */ false));
+
+        // Eva runtime (runtime/Async.cpp)
+        module->getOrInsertFunction("eva_schedule",
+                                    llvm::FunctionType::get(builder->getVoidTy(), /* task */ bytePtrTy, false));
+
+        module->getOrInsertFunction("eva_await",
+                                    llvm::FunctionType::get(builder->getVoidTy(), /* task */ bytePtrTy, false));
+
+        // Eva runtime (runtime/Region.cpp)
+        module->getOrInsertFunction("eva_region_push",
+                                    llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        module->getOrInsertFunction("eva_region_pop",
+                                    llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        module->getOrInsertFunction("eva_region_alloc",
+                                    llvm::FunctionType::get(bytePtrTy, /* size */ builder->getInt64Ty(), false));
+
+        // Fresh memory, like malloc's
+        module->getFunction("eva_region_alloc")->addRetAttr(llvm::Attribute::NoAlias);
+
+        // Worker regions of parallel-for chunks
+        module->getOrInsertFunction("eva_region_current",
+                                    llvm::FunctionType::get(bytePtrTy, false));
+
+        module->getOrInsertFunction("eva_region_enter",
+                                    llvm::FunctionType::get(builder->getVoidTy(), /* owner */ bytePtrTy, false));
+
+        module->getOrInsertFunction("eva_region_leave",
+                                    llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        // Eva runtime (runtime/String.cpp)
+        module->getOrInsertFunction("eva_str_len",
+                                    llvm::FunctionType::get(builder->getInt64Ty(), bytePtrTy, false));
+
+        module->getOrInsertFunction("eva_str_eq",
+                                    llvm::FunctionType::get(builder->getInt32Ty(), {bytePtrTy, bytePtrTy}, false));
+
+        module->getOrInsertFunction("eva_str_find",
+                                    llvm::FunctionType::get(builder->getInt64Ty(), {/* haystack */ bytePtrTy, /* needle */ bytePtrTy}, false));
+
+        // Lookups only read their arguments, so they can be hoisted out of loops
+        for (auto name : {"eva_str_len", "eva_str_eq", "eva_str_find"})
+        {
+            module->getFunction(name)->setOnlyReadsMemory();
+            module->getFunction(name)->setDoesNotThrow();
+        }
+
+        module->getOrInsertFunction("eva_str_concat",
+                                    llvm::FunctionType::get(bytePtrTy, {bytePtrTy, bytePtrTy}, false));
+
+        module->getOrInsertFunction("eva_str_split",
+                                    llvm::FunctionType::get(bytePtrTy->getPointerTo(), {bytePtrTy, /* separator */ bytePtrTy}, false));
+
+        // Eva runtime (runtime/Profile.cpp)
+        module->getOrInsertFunction("eva_profile_report",
+                                    llvm::FunctionType::get(builder->getVoidTy(), {/* table */ bytePtrTy, /* entries */ builder->getInt64Ty()}, false));
+
+        // Eva runtime (runtime/Parallel.cpp)
+        auto loopBodyTy = llvm::FunctionType::get(builder->getVoidTy(), {builder->getInt32Ty(), builder->getInt32Ty(), bytePtrTy}, false);
+
+        module->getOrInsertFunction("eva_parallel_for",
+                                    llvm::FunctionType::get(builder->getVoidTy(), {/* start */ builder->getInt32Ty(), /* end */ builder->getInt32Ty(), /* body */ loopBodyTy->getPointerTo(), /* ctx */ bytePtrTy}, false));
     }
 
-    void saveModuleToFile(const std::string &fileName)
+    /**
+     * Links the runtime bitcode (built by build-runtime.sh) into the module.
+     * Only the runtime functions the program uses are pulled in. Everything
+     * but main is then internalized, so the optimizer may inline & drop it.
+     *
+     * Without the bitcode, runtime calls stay external & the runtime
+     * is loaded as a shared library instead.
+     */
+    void linkRuntime(const std::string &fileName)
     {
-        std::error_code errorCode;
-        llvm::raw_fd_ostream outLL(fileName, errorCode);
-        module->print(outLL, nullptr);
+        if (!llvm::sys::fs::exists(fileName))
+        {
+            return;
+        }
+
+        llvm::SMDiagnostic error;
+        auto runtime = llvm::parseIRFile(fileName, error, *ctx);
+
+        if (runtime == nullptr)
+        {
+            DIE << "Cannot load runtime \"" << fileName << "\": " << error.getMessage().str();
+        }
+
+        if (llvm::Linker::linkModules(*module, std::move(runtime), llvm::Linker::Flags::LinkOnlyNeeded))
+        {
+            DIE << "Cannot link runtime \"" << fileName << "\".";
+        }
+
+        llvm::internalizeModule(*module, [](const llvm::GlobalValue &value)
+                                { return value.getName() == "main"; });
     }
 
-    void compile(const Exp &ast)
+    Exp parse(const std::string &source)
     {
-        fn = createFunction("main", llvm::FunctionType::get(builder->getInt32Ty(), false), GlobalEnv);
+        auto timer = stats.time("EvaParser::parse");
 
-        generate(ast, GlobalEnv);
+        return parser->parse(source);
+    }
 
-        builder->CreateRet(builder->getInt32(0));
+    size_t countTokens(const std::string &source)
+    {
+        auto &tokenizer = parser->tokenizer;
+        size_t tokens = 0;
+
+        tokenizer.initString(source);
+
+        while (tokenizer.getNextToken()->type != syntax::TokenType::__EOF)
+        {
+            tokens++;
+        }
+
+        return tokens;
     }
 
-    llvm::Value *generate(const Exp &exp, Env env)
+    size_t countNodes(const Exp &exp)
     {
+        size_t nodes = 1;
 
-        switch (exp.type)
+        for (auto &child : exp.list)
         {
-        case ExpType::NUMBER:
-            return builder->getInt32(exp.number);
+            nodes += countNodes(child);
+        }
 
-        case ExpType::STRING:
+        return nodes;
+    }
+
+    /**
+     * Functions, basic blocks & instructions defined in the module,
+     * as counters named with the given prefix
+     */
+    void countIR(const std::string &prefix)
+    {
+        size_t functions = 0, blocks = 0, instructions = 0;
+
+        for (auto &function : *module)
         {
-            auto re = std::regex("\\\\n");
-            auto str = std::regex_replace(exp.string, re, "\n");
+            if (function.isDeclaration())
+            {
+                continue;
+            }
 
-            return builder->CreateGlobalStringPtr(str);
+            functions++;
+            blocks += function.size();
+            instructions += function.getInstructionCount();
         }
 
-        case ExpType::SYMBOL:
-            // Boolean
-            if (exp.string == "true" || exp.string == "false")
+        auto name = [&](std::string counter)
+        {
+            if (!prefix.empty())
             {
-                return builder->getInt1(exp.string == "true" ? true : false);
+                counter[0] = toupper(counter[0]);
             }
-            else
-            {
-                auto varName = exp.string;
-                auto value = env->lookup(varName);
 
-                if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value))
-                {
-                    // Load local var onto stack
+            return prefix + counter;
+        };
+
+        stats.count(name("functions"), functions);
+        stats.count(name("basicBlocks"), blocks);
+        stats.count(name("instructions"), instructions);
+    }
+
+    /**
+     * Standard -O<n> pipeline of the new pass manager.
+     *
+     * PGO: instrumentation counts edges (& writes .profraw at exit, via
+     * the compiler-rt profile runtime); a merged profile turns into branch
+     * weights & function entry counts, which drive inlining & block layout.
+     */
+    void optimize()
+    {
+        llvm::LoopAnalysisManager loopAnalyses;
+        llvm::FunctionAnalysisManager functionAnalyses;
+        llvm::CGSCCAnalysisManager cgsccAnalyses;
+        llvm::ModuleAnalysisManager moduleAnalyses;
+
+        llvm::Optional<llvm::PGOOptions> pgo;
+
+        if (!options.pgoGenerate.empty())
+        {
+            pgo = llvm::PGOOptions(options.pgoGenerate, "", "", llvm::PGOOptions::IRInstr);
+        }
+        else if (!options.pgoUse.empty())
+        {
+            if (!llvm::sys::fs::exists(options.pgoUse))
+            {
+                DIE << "profile " << options.pgoUse << " not found";
+            }
+
+            pgo = llvm::PGOOptions(options.pgoUse, "", "", llvm::PGOOptions::IRUse);
+        }
+
+        llvm::PassBuilder passBuilder(targetMachine.get(), llvm::PipelineTuningOptions(), pgo);
+
+        passBuilder.registerModuleAnalyses(moduleAnalyses);
+        passBuilder.registerCGSCCAnalyses(cgsccAnalyses);
+        passBuilder.registerFunctionAnalyses(functionAnalyses);
+        passBuilder.registerLoopAnalyses(loopAnalyses);
+        passBuilder.crossRegisterProxies(loopAnalyses, functionAnalyses, cgsccAnalyses, moduleAnalyses);
+
+        static const llvm::OptimizationLevel levels[] = {
+            llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+            llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3};
+
+        auto level = levels[std::min(options.optLevel, 3)];
+
+        // -O0 still lowers coroutines (CoroEarly, CoroSplit, CoroCleanup).
+        // Separate compilation leaves inlining across modules & most
+        // loop transformations to the ThinLTO backends.
+        auto passes = level == llvm::OptimizationLevel::O0
+                          ? passBuilder.buildO0DefaultPipeline(level, !options.bitcodeFile.empty())
+                      : options.bitcodeFile.empty()
+                          ? passBuilder.buildPerModuleDefaultPipeline(level)
+                          : passBuilder.buildThinLTOPreLinkDefaultPipeline(level);
+        passes.run(*module, moduleAnalyses);
+    }
+
+    /**
+     * Async functions not yet split into ramp, resume & destroy
+     */
+    bool hasCoroutines()
+    {
+        for (auto &function : *module)
+        {
+            if (function.hasFnAttribute("coroutine.presplit"))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Bitcode with a ThinLTO module summary (call graph, references &
+     * a hash for the link cache)
+     */
+    void emitBitcodeFile(const std::string &fileName)
+    {
+        llvm::ProfileSummaryInfo profileSummary(*module);
+        auto index = llvm::buildModuleSummaryIndex(*module, nullptr, &profileSummary);
+
+        std::error_code errorCode;
+        llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+
+        if (errorCode)
+        {
+            DIE << "can't write " << fileName << ": " << errorCode.message();
+        }
+
+        llvm::WriteBitcodeToFile(*module, out, false, &index, /* GenerateHash */ true);
+    }
+
+    /**
+     * Machine code for the target, position independent so it links into PIE executables
+     */
+    void emitObjectFile(const std::string &fileName)
+    {
+        std::error_code errorCode;
+        llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+
+        if (errorCode)
+        {
+            DIE << "can't write " << fileName << ": " << errorCode.message();
+        }
+
+        llvm::legacy::PassManager codegen;
+
+        if (targetMachine->addPassesToEmitFile(codegen, out, nullptr, llvm::CGFT_ObjectFile))
+        {
+            DIE << "the target can't emit object files";
+        }
+
+        codegen.run(*module);
+    }
+
+    void saveModuleToFile(const std::string &fileName)
+    {
+        std::error_code errorCode;
+        llvm::raw_fd_ostream outLL(fileName, errorCode);
+        module->print(outLL, nullptr);
+    }
+
+    void compile(const Exp &ast)
+    {
+        // Libraries have no main
+        if (auto moduleExp = findModule(ast))
+        {
+            compileModule(*moduleExp);
+            return;
+        }
+
+        fn = createFunction("main", llvm::FunctionType::get(builder->getInt32Ty(), false), GlobalEnv);
+
+        auto profile = beginProfile();
+
+        generate(ast, GlobalEnv);
+
+        endProfile(profile);
+
+        // All functions are compiled by now
+        if (options.instrument)
+        {
+            reportProfile();
+        }
+
+        builder->CreateRet(builder->getInt32(0));
+    }
+
+    /**
+     * (module name <definitions & code>)
+     *
+     * Functions are exported to the modules importing this file. Other
+     * top-level code goes to `name.init`, which runs before main.
+     */
+    void compileModule(const Exp &moduleExp)
+    {
+        auto moduleName = moduleExp.list[1].string;
+
+        // Built-in globals (VERSION) are private to each module
+        for (auto &global : module->globals())
+        {
+            if (!global.isDeclaration())
+            {
+                global.setLinkage(llvm::GlobalValue::InternalLinkage);
+            }
+        }
+
+        fn = createFunction(moduleName + ".init", llvm::FunctionType::get(builder->getVoidTy(), false), GlobalEnv);
+        fn->setLinkage(llvm::Function::InternalLinkage);
+
+        for (auto i = 2; i < moduleExp.list.size(); i++)
+        {
+            generate(moduleExp.list[i], GlobalEnv);
+        }
+
+        builder->CreateRetVoid();
+
+        if (fn->size() == 1 && fn->getEntryBlock().size() == 1)
+        {
+            fn->eraseFromParent();
+        }
+        else
+        {
+            llvm::appendToGlobalCtors(*module, fn, 65535);
+        }
+    }
+
+    /**
+     * (import "math.eva")
+     *
+     * Declares the functions & struct types a module defines. Its code is
+     * compiled separately & linked by EvaBuild.
+     */
+    llvm::Value *compileImport(const Exp &importExp)
+    {
+        auto path = importPath(options.sourceFile, importExp.list[1].string);
+
+        if (!importedFiles.insert(path).second)
+        {
+            return builder->getInt32(0);
+        }
+
+        auto ast = parse("(begin " + readSourceFile(path) + ")");
+        auto moduleExp = findModule(ast);
+
+        if (moduleExp == nullptr)
+        {
+            DIE << "import: " << path << " is not a (module ...)";
+        }
+
+        for (auto &def : moduleExp->list)
+        {
+            if (def.type != ExpType::LIST || def.list.empty())
+            {
+                continue;
+            }
+
+            auto op = def.list[0].string;
+
+            if (op == "struct")
+            {
+                if (structs.count(extractVarName(def.list[1])) == 0)
+                {
+                    compileStruct(def);
+                }
+
+                continue;
+            }
+
+            if (op != "def" && op != "defmemo" && op != "defasync")
+            {
+                continue;
+            }
+
+            auto fnName = extractVarName(def.list[1]);
+            auto fnType = extractFunctionType(def);
+
+            // Coroutines return their handle
+            if (op == "defasync")
+            {
+                fnType = llvm::FunctionType::get(builder->getInt8PtrTy(), fnType->params(), false);
+            }
+
+            if (module->getFunction(fnName) == nullptr)
+            {
+                setArrayParamAttrs(createFunctionProto(fnName, fnType, GlobalEnv), def.list[2]);
+            }
+        }
+
+        return builder->getInt32(0);
+    }
+
+    llvm::Value *generate(const Exp &exp, Env env)
+    {
+        DebugLocationScope location(*this, exp);
+
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+            return builder->getInt32(exp.number);
+
+        case ExpType::STRING:
+            return builder->CreateGlobalStringPtr(unescapeString(exp.string));
+
+        case ExpType::SYMBOL:
+            // Boolean
+            if (exp.string == "true" || exp.string == "false")
+            {
+                return builder->getInt1(exp.string == "true" ? true : false);
+            }
+            else
+            {
+                auto varName = exp.string;
+                auto value = env->lookup(varName);
+
+                if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value); localVar && localVar->getAllocatedType()->isArrayTy())
+                {
+                    // Stack arrays decay to a pointer to the first element
+                    return builder->CreateConstInBoundsGEP2_32(localVar->getAllocatedType(), localVar, 0, 0, varName.c_str());
+                }
+                else if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value); localVar && isSoAStorage(localVar->getAllocatedType()))
+                {
+                    // SoA stack arrays decay to a struct of column pointers
+                    return createSoAView(localVar);
+                }
+                else if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value))
+                {
+                    // Load local var onto stack
                     return builder->CreateLoad(localVar->getAllocatedType(), localVar, varName.c_str());
                 }
                 else if (auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(value))
@@ -156,43 +1058,113 @@ private:
 
                 if (op == "+")
                 {
-                    GEN_BINARY_OP(CreateAdd, "tmpadd");
+                    GEN_ARITH_OP(CreateAdd, CreateFAdd, llvm::Intrinsic::sadd_with_overflow, "tmpadd");
                 }
                 else if (op == "-")
                 {
-                    GEN_BINARY_OP(CreateSub, "tmpsub");
+                    GEN_ARITH_OP(CreateSub, CreateFSub, llvm::Intrinsic::ssub_with_overflow, "tmpsub");
                 }
                 else if (op == "*")
                 {
-                    GEN_BINARY_OP(CreateMul, "tmpmul");
+                    GEN_ARITH_OP(CreateMul, CreateFMul, llvm::Intrinsic::smul_with_overflow, "tmpmul");
                 }
                 else if (op == "/")
                 {
-                    GEN_BINARY_OP(CreateSDiv, "tmpdiv");
+                    auto op1 = generate(exp.list[1], env);
+                    auto op2 = generate(exp.list[2], env);
+
+                    coerceOperands(op1, op2);
+
+                    if (op1->getType()->isFPOrFPVectorTy())
+                    {
+                        return builder->CreateFDiv(op1, op2, "tmpdiv");
+                    }
+
+                    if (options.checkedArithmetic && !op1->getType()->isVectorTy())
+                    {
+                        checkDivision(op1, op2);
+                    }
+
+                    return builder->CreateSDiv(op1, op2, "tmpdiv");
                 }
                 else if (op == ">")
                 {
-                    GEN_BINARY_OP(CreateICmpUGT, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpSGT, CreateFCmpOGT, "tmpcmp");
                 }
                 else if (op == "<")
                 {
-                    GEN_BINARY_OP(CreateICmpULT, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpSLT, CreateFCmpOLT, "tmpcmp");
                 }
                 else if (op == "==")
                 {
-                    GEN_BINARY_OP(CreateICmpEQ, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpEQ, CreateFCmpOEQ, "tmpcmp");
                 }
                 else if (op == "!=")
                 {
-                    GEN_BINARY_OP(CreateICmpNE, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpNE, CreateFCmpUNE, "tmpcmp");
                 }
                 else if (op == ">=")
                 {
-                    GEN_BINARY_OP(CreateICmpUGE, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpSGE, CreateFCmpOGE, "tmpcmp");
                 }
                 else if (op == "<=")
                 {
-                    GEN_BINARY_OP(CreateICmpULE, "tmpcmp");
+                    GEN_NUMERIC_OP(CreateICmpSLE, CreateFCmpOLE, "tmpcmp");
+                }
+                // Vector literal: (vector (vec f64 4) 1 2 3 4)
+                else if (op == "vector")
+                {
+                    auto vecType = llvm::cast<llvm::FixedVectorType>(getType(exp.list[1]));
+                    llvm::Value *vec = llvm::UndefValue::get(vecType);
+
+                    for (auto i = 2; i < exp.list.size(); i++)
+                    {
+                        auto elem = castValue(generate(exp.list[i], env), vecType->getElementType());
+                        vec = builder->CreateInsertElement(vec, elem, i - 2, "tmpvec");
+                    }
+
+                    return vec;
+                }
+                // Broadcast: (splat (vec f64 4) 1)
+                else if (op == "splat")
+                {
+                    auto vecType = llvm::cast<llvm::FixedVectorType>(getType(exp.list[1]));
+                    auto elem = castValue(generate(exp.list[2], env), vecType->getElementType());
+
+                    return builder->CreateVectorSplat(vecType->getNumElements(), elem, "tmpsplat");
+                }
+                // (extract v 2)
+                else if (op == "extract")
+                {
+                    auto vec = generate(exp.list[1], env);
+                    auto index = generate(exp.list[2], env);
+
+                    return builder->CreateExtractElement(vec, index, "tmpextract");
+                }
+                // (insert v 2 42)
+                else if (op == "insert")
+                {
+                    auto vec = generate(exp.list[1], env);
+                    auto index = generate(exp.list[2], env);
+                    auto elem = castValue(generate(exp.list[3], env), vec->getType()->getScalarType());
+
+                    return builder->CreateInsertElement(vec, elem, index, "tmpinsert");
+                }
+                // Element-wise choice: (select (< a b) a b)
+                else if (op == "select")
+                {
+                    auto mask = generate(exp.list[1], env);
+                    auto op1 = generate(exp.list[2], env);
+                    auto op2 = generate(exp.list[3], env);
+
+                    coerceOperands(op1, op2);
+
+                    return builder->CreateSelect(mask, op1, op2, "tmpselect");
+                }
+                // Horizontal reductions: (reduce-add v)
+                else if (op == "reduce-add" || op == "reduce-mul" || op == "reduce-min" || op == "reduce-max")
+                {
+                    return createReduction(op, generate(exp.list[1], env));
                 }
                 // (if <cond> <then> <else>)
                 else if (op == "if")
@@ -236,6 +1208,25 @@ private:
 
                     return phi;
                 }
+                // Logic: (and a b ...), (or a b ...), (not a)
+                else if (op == "and" || op == "or")
+                {
+                    return compileLogical(exp, env);
+                }
+                else if (op == "not")
+                {
+                    return builder->CreateNot(toBool(generate(exp.list[1], env)), "tmpnot");
+                }
+                // Multiway branch on an integer: (switch x (1 e1) ((2 3) e2) (default e))
+                else if (op == "switch")
+                {
+                    return compileSwitch(exp, env);
+                }
+                // First true test wins: (cond ((< x 0) e1) ((> x 9) e2) (else e))
+                else if (op == "cond")
+                {
+                    return compileCond(exp, env);
+                }
                 else if (op == "while")
                 {
                     auto condBlock = createBB("cond", fn);
@@ -251,6 +1242,7 @@ private:
 
                     fn->getBasicBlockList().push_back(bodyBlock);
                     builder->SetInsertPoint(bodyBlock);
+                    countLoopIteration("while");
                     generate(exp.list[2], env);
                     builder->CreateBr(condBlock);
 
@@ -259,233 +1251,2456 @@ private:
 
                     return builder->getInt32(0);
                 }
+                // Counted loop: (for (i 0 n) <body>)
+                // With step & hints: (for (i 0 n 2) (unroll 4) (vectorize 8) <body>)
+                else if (op == "for")
+                {
+                    return compileFor(exp, env);
+                }
+                // Loop body runs on all cores: (parallel-for (i 0 n) <body>)
+                else if (op == "parallel-for")
+                {
+                    return compileParallelFor(exp, env);
+                }
                 else if (op == "def")
                 {
                     return compileFunction(exp, env);
                 }
+                // Cached pure function: (defmemo fib (n) <body>)
+                // With capacity & eviction: (defmemo (fib 4096 keep) (n) <body>)
+                else if (op == "defmemo")
+                {
+                    return compileMemoFunction(exp, env);
+                }
+                // Coroutines: (defasync name (params) <body>)
+                else if (op == "defasync")
+                {
+                    return compileAsyncFunction(exp, env);
+                }
+                // (await (fetch 1)), (await task)
+                else if (op == "await")
+                {
+                    return compileAwait(exp, env);
+                }
+                // Lets other ready tasks run: (yield)
+                else if (op == "yield")
+                {
+                    if (coro.handle == nullptr)
+                    {
+                        DIE << "(yield) outside of an async function.";
+                    }
+
+                    builder->CreateCall(module->getFunction("eva_schedule"), {coro.handle});
+                    createSuspend(/* final */ false);
+
+                    return builder->getInt32(0);
+                }
                 // Variable declaration & init: (var x (+ y 10))
                 // Typed: (var (x number) 42)
+                // Stack array, zero-initialized: (var (a (array number 100)))
                 else if (op == "var")
                 {
                     auto varNameDecl = exp.list[1];
-                    auto init = generate(exp.list[2], env);
 
                     auto varName = extractVarName(varNameDecl);
                     auto varType = extractVarType(varNameDecl);
+
+                    if (exp.list.size() == 2)
+                    {
+                        auto varBinding = allocVar(varName, varType, env);
+                        auto size = module->getDataLayout().getTypeAllocSize(varType);
+
+                        return builder->CreateMemSet(varBinding, builder->getInt8(0), size, llvm::MaybeAlign(16));
+                    }
+
+                    auto init = generate(exp.list[2], env);
                     auto varBinding = allocVar(varName, varType, env);
 
                     // Store on stack
-                    return builder->CreateStore(init, varBinding);
+                    return builder->CreateStore(castValue(init, varType), varBinding);
                 }
+                // Variables: (set x 10)
+                // Array elements: (set (get a i) 10)
                 else if (op == "set")
                 {
                     auto value = generate(exp.list[2], env);
+                    auto address = generateAddress(exp.list[1], env);
+
+                    value = castValue(value, address->getType()->getPointerElementType());
+                    builder->CreateStore(value, address);
+
+                    return value;
+                }
+                // Array element: (get a i)
+                else if (op == "get")
+                {
+                    auto address = generateAddress(exp, env);
+
+                    return builder->CreateLoad(address->getType()->getPointerElementType(), address, "tmpget");
+                }
+                // Region-allocated array: (make-array number n)
+                else if (op == "make-array")
+                {
+                    auto elemType = getType(exp.list[1]);
+                    auto count = builder->CreateSExt(generate(exp.list[2], env), builder->getInt64Ty());
+
+                    // SoA: one buffer per field
+                    if (auto layout = getSoALayout(elemType))
+                    {
+                        auto viewType = getSoAType(*layout, 0);
+                        llvm::Value *view = llvm::UndefValue::get(viewType);
+
+                        for (auto i = 0; i < layout->fields.size(); i++)
+                        {
+                            auto fieldType = layout->type->getElementType(i);
+                            view = builder->CreateInsertValue(view, allocBuffer(fieldType, count), i, "tmpsoa");
+                        }
+
+                        return view;
+                    }
+
+                    return allocBuffer(elemType, count);
+                }
+                // Record type: (struct Point (x number) (y number))
+                // Arrays of it in SoA layout: (struct (Point soa) (x number) (y number))
+                else if (op == "struct")
+                {
+                    return compileStruct(exp);
+                }
+                // Separate compilation: (import "math.eva")
+                else if (op == "import")
+                {
+                    return compileImport(exp);
+                }
+                else if (op == "module")
+                {
+                    DIE << "module " << exp.list[1].string << ": (module ...) must be the only form of its file";
+                }
+                // Struct field: (field p x), (field (get points i) x)
+                else if (op == "field")
+                {
+                    auto object = exp.list[1];
+
+                    if (object.type == ExpType::SYMBOL || object.list[0].string == "get" || object.list[0].string == "field")
+                    {
+                        auto address = generateAddress(exp, env);
+
+                        return builder->CreateLoad(address->getType()->getPointerElementType(), address, "tmpfield");
+                    }
+
+                    // Struct value, e.g. returned from a function
+                    auto value = generate(object, env);
+                    auto &layout = getStructLayout(value->getType());
+
+                    return builder->CreateExtractValue(value, getFieldIndex(layout, exp.list[2].string), "tmpfield");
+                }
+                // Blocks: (begin <expression>)
+                else if (op == "begin")
+                {
+                    auto blockEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
+
+                    llvm::Value *blockResult;
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        blockResult = generate(exp.list[i], blockEnv);
+                    }
+
+                    return blockResult;
+                }
+                // Regions: (with-region <expression>)
+                //
+                // Arrays & strings allocated inside are freed on exit,
+                // so the result must not refer to them.
+                else if (op == "with-region")
+                {
+                    builder->CreateCall(module->getFunction("eva_region_push"));
+
+                    auto blockEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
+
+                    llvm::Value *blockResult;
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        blockResult = generate(exp.list[i], blockEnv);
+                    }
+
+                    builder->CreateCall(module->getFunction("eva_region_pop"));
+
+                    return blockResult;
+                }
+                // printf(): (printf "Value: %d" 42)
+                else if (op == "printf")
+                {
+                    return compilePrintf(exp, env);
+                }
+                // Typed output: (print-int x), (print-str s), (print-f64 x), (print-char c)
+                else if (op == "print-int" || op == "print-str" || op == "print-f64" || op == "print-char")
+                {
+                    auto printFn = module->getFunction("eva_" + std::regex_replace(op, std::regex("-"), "_"));
+                    auto value = generate(exp.list[1], env);
+
+                    return builder->CreateCall(printFn, {castPrintArg(value, printFn->getArg(0)->getType())});
+                }
+                // Strings: (str-len s), (str-eq a b), (str-find s "needle"),
+                // (str-concat a b), (str-split s ",")
+                //
+                // Split parts are followed by a null entry: (== (get parts i) 0)
+                else if (op == "str-len" || op == "str-eq" || op == "str-find" || op == "str-concat" || op == "str-split")
+                {
+                    auto strFn = module->getFunction("eva_" + std::regex_replace(op, std::regex("-"), "_"));
+
+                    std::vector<llvm::Value *> args{};
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        args.push_back(generate(exp.list[i], env));
+                    }
+
+                    auto result = builder->CreateCall(strFn, args);
+
+                    if (op == "str-eq")
+                    {
+                        return builder->CreateICmpNE(result, builder->getInt32(0), "tmpeq");
+                    }
+
+                    // Lengths & indices are numbers
+                    if (op == "str-len" || op == "str-find")
+                    {
+                        return builder->CreateTrunc(result, builder->getInt32Ty(), "tmpidx");
+                    }
+
+                    return result;
+                }
+                // Writes out buffered output: (flush)
+                else if (op == "flush")
+                {
+                    builder->CreateCall(module->getFunction("eva_flush"));
+
+                    return builder->getInt32(0);
+                }
+                // Intrinsics: (popcount x), (sqrt x), (fma a b c), (min a b), ...
+                else if (intrinsicBuiltins.count(op) != 0)
+                {
+                    return compileIntrinsic(exp, env);
+                }
+                // Struct constructor: (Point 1 2)
+                else if (structs.count(op) != 0)
+                {
+                    auto &layout = structs[op];
+                    llvm::Value *value = llvm::UndefValue::get(layout.type);
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        auto fieldValue = castValue(generate(exp.list[i], env), layout.type->getElementType(i - 1));
+                        value = builder->CreateInsertValue(value, fieldValue, i - 1, "tmpstruct");
+                    }
+
+                    return value;
+                }
+                // Function calls
+                else
+                {
+                    auto callable = generate(exp.list[0], env);
+                    auto fn = (llvm::Function *)callable;
+
+                    std::vector<llvm::Value *> args{};
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        auto arg = generate(exp.list[i], env);
+
+                        // Numbers convert to typed params: (f 1) for f64 x
+                        if (i - 1 < fn->arg_size())
+                        {
+                            arg = castValue(arg, fn->getArg(i - 1)->getType());
+                        }
+
+                        args.push_back(arg);
+                    }
+
+                    checkDistinctArrays(exp, fn, args);
+
+                    return builder->CreateCall(fn, args);
+                }
+            }
+        }
+
+        // Unreachable
+        return builder->getInt32(0);
+    }
+
+    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init)
+    {
+        module->getOrInsertGlobal(name, init->getType());
+        auto variable = module->getNamedGlobal(name);
+        variable->setAlignment(llvm::MaybeAlign(4));
+        variable->setConstant(false);
+        variable->setInitializer(init);
+
+        return variable;
+    }
+
+    /**
+     * Functions consist of:
+     * - Function type: Param types / return type / varargs?
+     * - Blocks; always there: entry block
+     *     - Optimization takes place here
+     * - Control flow blocks: Branch instructions: Conditionals, jumps
+     */
+    llvm::Function *createFunction(const std::string &fnName, llvm::FunctionType *fnType, Env env)
+    {
+        // Function prototype might already be defined
+        auto fn = module->getFunction(fnName);
+
+        if (fn == nullptr)
+        {
+            fn = createFunctionProto(fnName, fnType, env);
+        }
+
+        createFunctionBlock(fn);
+
+        return fn;
+    }
+
+    llvm::Function *createFunctionProto(const std::string &fnName, llvm::FunctionType *fnType, Env env)
+    {
+        auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage, fnName, *module);
+
+        verifyFunction(*fn);
+
+        env->define(fnName, fn);
+
+        return fn;
+    }
+
+    void createFunctionBlock(llvm::Function *fn)
+    {
+        auto entry = createBB("entry", fn);
+        // Emit code exactly into this block
+        builder->SetInsertPoint(entry);
+
+        if (diBuilder)
+        {
+            createSubprogram(fn);
+        }
+    }
+
+    /**
+     * Debug info of a function, at the line of the expression defining it
+     * (the current location). Its prologue is attributed to that line.
+     */
+    void createSubprogram(llvm::Function *fn)
+    {
+        auto defLoc = builder->getCurrentDebugLocation();
+        auto line = defLoc ? defLoc.getLine() : options.firstLine;
+
+        auto spFlags = llvm::DISubprogram::SPFlagDefinition;
+
+        if (options.optLevel > 0)
+        {
+            spFlags |= llvm::DISubprogram::SPFlagOptimized;
+        }
+
+        auto fnType = diBuilder->createSubroutineType(diBuilder->getOrCreateTypeArray({}));
+        auto subprogram = diBuilder->createFunction(debugFile, fn->getName(), fn->getName(), debugFile, line, fnType, line,
+                                                    llvm::DINode::FlagPrototyped, spFlags);
+        fn->setSubprogram(subprogram);
+
+        resetDebugLocation(fn);
+    }
+
+    /**
+     * Location for code of fn that belongs to no expression
+     */
+    void resetDebugLocation(llvm::Function *fn)
+    {
+        if (auto subprogram = fn->getSubprogram())
+        {
+            builder->SetCurrentDebugLocation(llvm::DILocation::get(*ctx, subprogram->getLine(), 0, subprogram));
+        }
+    }
+
+    /**
+     * Attributes the instructions of an expression to its source line,
+     * and restores the enclosing expression's location at the end of scope
+     */
+    class DebugLocationScope
+    {
+    public:
+        DebugLocationScope(EvaLLVM &vm, const Exp &exp)
+            : builder_(*vm.builder), saved_(vm.builder->getCurrentDebugLocation())
+        {
+            if (vm.diBuilder && exp.line > 0)
+            {
+                auto subprogram = vm.fn->getSubprogram();
+                auto line = exp.line + vm.options.firstLine - 1;
+
+                builder_.SetCurrentDebugLocation(llvm::DILocation::get(*vm.ctx, line, exp.column + 1, subprogram));
+            }
+        }
+
+        ~DebugLocationScope()
+        {
+            builder_.SetCurrentDebugLocation(saved_);
+        }
+
+    private:
+        llvm::IRBuilder<> &builder_;
+        llvm::DebugLoc saved_;
+    };
+
+    std::string extractVarName(const Exp &exp)
+    {
+        return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
+    }
+
+    // Default: i32
+    llvm::Type *extractVarType(const Exp &exp)
+    {
+        return exp.type == ExpType::LIST ? getType(exp.list[1]) : builder->getInt32Ty();
+    }
+
+    /**
+     * Simple types: number, string, ...
+     * Vectors: (vec f64 4)
+     * Arrays: (array number 100) - fixed size, on the stack
+     *         (array number) - pointer to a contiguous buffer
+     * Structs: Point
+     *
+     * Arrays of SoA structs become a struct of per-field arrays:
+     * (array Point 100) -> { [100 x i32], [100 x i32] }
+     * (array Point) -> { i32*, i32* }
+     */
+    llvm::Type *getType(const Exp &typeExp)
+    {
+        if (typeExp.type != ExpType::LIST)
+        {
+            return getTypeFromString(typeExp.string);
+        }
+
+        auto kind = typeExp.list[0].string;
+
+        if (kind == "vec")
+        {
+            return llvm::FixedVectorType::get(getType(typeExp.list[1]), typeExp.list[2].number);
+        }
+
+        if (kind == "array")
+        {
+            auto elemType = getType(typeExp.list[1]);
+
+            if (auto layout = getSoALayout(elemType))
+            {
+                return getSoAType(*layout, typeExp.list.size() == 3 ? typeExp.list[2].number : 0);
+            }
+
+            return typeExp.list.size() == 3 ? (llvm::Type *)llvm::ArrayType::get(elemType, typeExp.list[2].number) : elemType->getPointerTo();
+        }
+
+        DIE << "Unknown type \"" << kind << "\".";
+        return nullptr;
+    }
+
+    llvm::Type *getTypeFromString(const std::string &type_)
+    {
+        if (type_ == "number" || type_ == "i32")
+        {
+            return builder->getInt32Ty();
+        }
+
+        if (type_ == "i64")
+        {
+            return builder->getInt64Ty();
+        }
+
+        if (type_ == "f32")
+        {
+            return builder->getFloatTy();
+        }
+
+        if (type_ == "f64")
+        {
+            return builder->getDoubleTy();
+        }
+
+        if (type_ == "boolean")
+        {
+            return builder->getInt1Ty();
+        }
+
+        if (type_ == "string")
+        {
+            // aka char*
+            return builder->getInt8Ty()->getPointerTo();
+        }
+
+        if (type_ == "task")
+        {
+            // Coroutine handle
+            return builder->getInt8Ty()->getPointerTo();
+        }
+
+        if (structs.count(type_) != 0)
+        {
+            return structs[type_].type;
+        }
+
+        // Default
+        return builder->getInt32Ty();
+    }
+
+    bool isArrayType(const Exp &typeExp)
+    {
+        return typeExp.type == ExpType::LIST && typeExp.list[0].string == "array";
+    }
+
+    /**
+     * Address of an assignable place:
+     * - variable: x
+     * - array element: (get a i)
+     * - struct field: (field p x), (field (get points i) x)
+     */
+    llvm::Value *generateAddress(const Exp &exp, Env env)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            auto binding = env->lookup(exp.string);
+
+            // Induction variables of (for ...) are phis, not memory
+            if (llvm::isa<llvm::PHINode>(binding))
+            {
+                DIE << "cannot assign to loop variable " << exp.string;
+            }
+
+            if (!llvm::isa<llvm::AllocaInst>(binding) && !llvm::isa<llvm::GlobalVariable>(binding))
+            {
+                DIE << "cannot assign to " << exp.string;
+            }
+
+            return binding;
+        }
+
+        if (exp.list[0].string == "field")
+        {
+            return generateFieldAddress(exp, env);
+        }
+
+        auto arrayExp = exp.list[1];
+
+        if (getSoAColumns(arrayExp, env) != nullptr)
+        {
+            DIE << "Elements of SoA array \"" << arrayExp.string << "\" are only accessible by field.";
+        }
+
+        auto index = generate(exp.list[2], env);
+
+        // Stack array: index the aggregate directly
+        if (arrayExp.type == ExpType::SYMBOL)
+        {
+            auto binding = env->lookup(arrayExp.string);
+
+            if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(binding); localVar && localVar->getAllocatedType()->isArrayTy())
+            {
+                return builder->CreateInBoundsGEP(localVar->getAllocatedType(), localVar, {builder->getInt32(0), index}, "tmpelem");
+            }
+        }
+
+        // Buffer pointer
+        auto base = generate(arrayExp, env);
+
+        return builder->CreateInBoundsGEP(base->getType()->getPointerElementType(), base, index, "tmpelem");
+    }
+
+    /**
+     * Lowered to a guarded, rotated loop with the induction variable
+     * as a phi & the exit test in the latch:
+     *
+     * guard:  br (start < end), body, forend
+     * body:   i = phi [start, guard], [i.next, latch]
+     *         ...
+     * latch:  more = (end - i) >u step
+     *         i.next = add nsw i, step
+     *         br more, body, forend   ; !llvm.loop hints
+     *
+     * The latch tests the distance left before stepping, so a last value
+     * within one step of INT_MAX (INT_MIN counting down) doesn't overflow;
+     * i.next is only used when it's in range, which makes it nsw.
+     */
+    llvm::Value *compileFor(const Exp &forExp, Env env)
+    {
+        auto header = forExp.list[1];
+        auto varName = header.list[0].string;
+
+        auto start = generate(header.list[1], env);
+        auto end = generate(header.list[2], env);
+        auto step = header.list.size() > 3 ? generate(header.list[3], env) : builder->getInt32(1);
+
+        // Counting down with a negative step: decided here for a constant
+        // step, at run time otherwise
+        auto stepConst = llvm::dyn_cast<llvm::ConstantInt>(step);
+        auto countsDown = stepConst == nullptr ? builder->CreateICmpSLT(step, builder->getInt32(0), "countsdown") : nullptr;
+
+        auto inRange = [&](llvm::Value *i, const char *name)
+        {
+            if (stepConst != nullptr)
+            {
+                return stepConst->isNegative() ? builder->CreateICmpSGT(i, end, name) : builder->CreateICmpSLT(i, end, name);
+            }
+
+            return builder->CreateSelect(countsDown, builder->CreateICmpSGT(i, end), builder->CreateICmpSLT(i, end), name);
+        };
+
+        // Another step fits before the bound: i is in range, so the
+        // distance to end is exact as an unsigned number
+        auto hasNext = [&](llvm::Value *i, const char *name)
+        {
+            auto up = [&]
+            { return builder->CreateICmpUGT(builder->CreateSub(end, i), step, name); };
+            auto down = [&]
+            { return builder->CreateICmpUGT(builder->CreateSub(i, end), builder->CreateNeg(step), name); };
+
+            if (stepConst != nullptr)
+            {
+                return stepConst->isNegative() ? down() : up();
+            }
+
+            return builder->CreateSelect(countsDown, down(), up(), name);
+        };
+
+        auto guardBlock = builder->GetInsertBlock();
+        auto bodyBlock = createBB("forbody");
+        auto forEndBlock = createBB("forend");
+
+        builder->CreateCondBr(inRange(start, "forguard"), bodyBlock, forEndBlock);
+
+        fn->getBasicBlockList().push_back(bodyBlock);
+        builder->SetInsertPoint(bodyBlock);
+
+        auto indVar = builder->CreatePHI(start->getType(), 2, varName.c_str());
+        indVar->addIncoming(start, guardBlock);
+
+        auto bodyEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{{varName, indVar}}, env);
+
+        countLoopIteration("for " + varName);
+
+        generate(forExp.list[forExp.list.size() - 1], bodyEnv);
+
+        auto more = hasNext(indVar, "forcond");
+        auto next = builder->CreateNSWAdd(indVar, step, (varName + ".next").c_str());
+        auto backEdge = builder->CreateCondBr(more, bodyBlock, forEndBlock);
+        indVar->addIncoming(next, builder->GetInsertBlock());
+
+        // Hints between the header & the body
+        std::vector<std::pair<std::string, llvm::Constant *>> hints{};
+
+        for (auto i = 2; i < forExp.list.size() - 1; i++)
+        {
+            addLoopHint(forExp.list[i], hints);
+        }
+
+        if (!hints.empty())
+        {
+            backEdge->setMetadata("llvm.loop", createLoopMetadata(hints));
+        }
+
+        fn->getBasicBlockList().push_back(forEndBlock);
+        builder->SetInsertPoint(forEndBlock);
+
+        return builder->getInt32(0);
+    }
+
+    /**
+     * The body is outlined into
+     *   void <fn>.parallel(i32 chunkStart, i32 chunkEnd, i8* ctx)
+     * which runs the loop over one chunk, & handed to the runtime's
+     * eva_parallel_for.
+     *
+     * Locals used by the body are copied into a context struct:
+     * arrays travel as pointers, so element writes are shared,
+     * while writes to captured scalars stay private to the chunk.
+     */
+    llvm::Value *compileParallelFor(const Exp &parExp, Env env)
+    {
+        auto body = parExp.list[parExp.list.size() - 1];
+
+        // Captures: locals of the current function used in the body
+        std::set<std::string> symbols{};
+        collectSymbols(body, symbols);
+
+        std::vector<std::string> captureNames{};
+        std::vector<llvm::Value *> captures{};
+        std::vector<llvm::Type *> captureTypes{};
+
+        for (auto &name : symbols)
+        {
+            if (!env->isDefined(name) || !llvm::isa<llvm::Instruction>(env->lookup(name)))
+            {
+                continue;
+            }
+
+            auto value = generate(symbolExp(name), env);
+
+            captureNames.push_back(name);
+            captures.push_back(value);
+            captureTypes.push_back(value->getType());
+        }
+
+        auto start = generate(parExp.list[1].list[1], env);
+        auto end = generate(parExp.list[1].list[2], env);
+
+        // Context struct on the caller's stack; the caller's region
+        // comes last
+        auto regionIndex = captures.size();
+        captures.push_back(builder->CreateCall(module->getFunction("eva_region_current"), {}, "region"));
+        captureTypes.push_back(builder->getInt8PtrTy());
+
+        auto ctxType = llvm::StructType::get(*ctx, captureTypes);
+        setVarsInsertPoint();
+        auto ctxAlloc = varsBuilder->CreateAlloca(ctxType, 0, "parctx");
+
+        for (auto i = 0; i < captures.size(); i++)
+        {
+            builder->CreateStore(captures[i], builder->CreateStructGEP(ctxType, ctxAlloc, i));
+        }
+
+        // Outlined chunk function
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+        auto prevLocation = builder->getCurrentDebugLocation();
+
+        auto loopBodyTy = llvm::FunctionType::get(builder->getVoidTy(), {builder->getInt32Ty(), builder->getInt32Ty(), builder->getInt8PtrTy()}, false);
+        auto chunkFn = llvm::Function::Create(loopBodyTy, llvm::Function::InternalLinkage, fn->getName() + ".parallel", *module);
+        fn = chunkFn;
+        createFunctionBlock(chunkFn);
+
+        auto chunkStart = chunkFn->getArg(0);
+        auto chunkEnd = chunkFn->getArg(1);
+        auto ctxArg = chunkFn->getArg(2);
+        chunkStart->setName("chunkStart");
+        chunkEnd->setName("chunkEnd");
+        ctxArg->setName("ctx");
+        ctxArg->addAttr(llvm::Attribute::NoAlias);
+
+        auto chunkEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{{"__chunkStart", chunkStart}, {"__chunkEnd", chunkEnd}}, env);
+        auto chunkCtx = builder->CreateBitCast(ctxArg, ctxType->getPointerTo(), "chunkctx");
+
+        for (auto i = 0; i < captureNames.size(); i++)
+        {
+            auto value = builder->CreateLoad(captureTypes[i], builder->CreateStructGEP(ctxType, chunkCtx, i), captureNames[i].c_str());
+            builder->CreateStore(value, allocVar(captureNames[i], captureTypes[i], chunkEnv));
+        }
+
+        // Arrays & strings the chunk allocates are freed with the
+        // caller's region, whichever thread runs it
+        auto region = builder->CreateLoad(builder->getInt8PtrTy(), builder->CreateStructGEP(ctxType, chunkCtx, regionIndex), "region");
+        builder->CreateCall(module->getFunction("eva_region_enter"), {region});
+
+        // Same loop, over the chunk: (for (i __chunkStart __chunkEnd) <hints> <body>)
+        auto loopExp = parExp;
+        loopExp.list[0] = symbolExp("for");
+        loopExp.list[1].list = {parExp.list[1].list[0], symbolExp("__chunkStart"), symbolExp("__chunkEnd")};
+
+        compileFor(loopExp, chunkEnv);
+        builder->CreateCall(module->getFunction("eva_region_leave"));
+        builder->CreateRetVoid();
+
+        builder->SetInsertPoint(prevBlock);
+        builder->SetCurrentDebugLocation(prevLocation);
+        fn = prevFn;
+
+        builder->CreateCall(module->getFunction("eva_parallel_for"),
+                            {start, end, chunkFn, builder->CreateBitCast(ctxAlloc, builder->getInt8PtrTy())});
+
+        return builder->getInt32(0);
+    }
+
+    void collectSymbols(const Exp &exp, std::set<std::string> &symbols)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            symbols.insert(exp.string);
+        }
+        else if (exp.type == ExpType::LIST)
+        {
+            for (auto &item : exp.list)
+            {
+                collectSymbols(item, symbols);
+            }
+        }
+    }
+
+    Exp symbolExp(std::string name)
+    {
+        return Exp(name);
+    }
+
+    /**
+     * (unroll 4), (unroll full), (unroll none)
+     * (vectorize 8), (vectorize none)
+     * (interleave 2)
+     */
+    void addLoopHint(const Exp &hintExp, std::vector<std::pair<std::string, llvm::Constant *>> &hints)
+    {
+        auto name = hintExp.list[0].string;
+        auto arg = hintExp.list[1];
+
+        if (name == "unroll")
+        {
+            if (arg.type == ExpType::NUMBER)
+            {
+                hints.push_back({"llvm.loop.unroll.count", builder->getInt32(arg.number)});
+            }
+            else
+            {
+                hints.push_back({arg.string == "full" ? "llvm.loop.unroll.full" : "llvm.loop.unroll.disable", nullptr});
+            }
+        }
+        else if (name == "vectorize")
+        {
+            auto enable = arg.type == ExpType::NUMBER;
+
+            hints.push_back({"llvm.loop.vectorize.enable", builder->getInt1(enable)});
+
+            if (enable)
+            {
+                hints.push_back({"llvm.loop.vectorize.width", builder->getInt32(arg.number)});
+            }
+        }
+        else if (name == "interleave")
+        {
+            hints.push_back({"llvm.loop.interleave.count", builder->getInt32(arg.number)});
+        }
+        else
+        {
+            DIE << "Unknown loop hint \"" << name << "\".";
+        }
+    }
+
+    /**
+     * AoS: address of the element, then of the field.
+     * SoA: address of the column, then of the element.
+     */
+    llvm::Value *generateFieldAddress(const Exp &exp, Env env)
+    {
+        auto object = exp.list[1];
+        auto fieldName = exp.list[2].string;
+
+        if (object.type == ExpType::LIST && object.list[0].string == "get")
+        {
+            if (auto columns = getSoAColumns(object.list[1], env))
+            {
+                auto localVar = llvm::dyn_cast<llvm::AllocaInst>(columns);
+                auto &layout = *getSoALayout(localVar ? localVar->getAllocatedType() : columns->getType());
+                auto fieldIndex = getFieldIndex(layout, fieldName);
+                auto index = generate(object.list[2], env);
+
+                // Stack storage: { [N x T1], [N x T2], ... }
+                if (localVar)
+                {
+                    auto storageType = localVar->getAllocatedType();
+                    return builder->CreateInBoundsGEP(storageType, localVar, {builder->getInt32(0), builder->getInt32(fieldIndex), index}, "tmpfield");
+                }
+
+                // View: { T1*, T2*, ... }
+                auto column = builder->CreateExtractValue(columns, fieldIndex, "tmpcolumn");
+                return builder->CreateInBoundsGEP(column->getType()->getPointerElementType(), column, index, "tmpfield");
+            }
+        }
+
+        auto objectAddress = generateAddress(object, env);
+        auto structType = objectAddress->getType()->getPointerElementType();
+        auto fieldIndex = getFieldIndex(getStructLayout(structType), fieldName);
+
+        return builder->CreateStructGEP(structType, objectAddress, fieldIndex, "tmpfield");
+    }
+
+    /**
+     * (struct Point (x number) (y number))
+     * (struct (Point soa) (x number) (y number))
+     */
+    llvm::Value *compileStruct(const Exp &structExp)
+    {
+        auto nameDecl = structExp.list[1];
+        auto name = extractVarName(nameDecl);
+
+        StructLayout layout;
+        layout.soa = nameDecl.type == ExpType::LIST && nameDecl.list[1].string == "soa";
+
+        std::vector<llvm::Type *> fieldTypes{};
+
+        for (auto i = 2; i < structExp.list.size(); i++)
+        {
+            layout.fields.push_back(extractVarName(structExp.list[i]));
+            fieldTypes.push_back(extractVarType(structExp.list[i]));
+        }
+
+        layout.type = llvm::StructType::create(*ctx, fieldTypes, name);
+        structs[name] = layout;
+
+        return builder->getInt32(0);
+    }
+
+    StructLayout &getStructLayout(llvm::Type *type_)
+    {
+        for (auto &entry : structs)
+        {
+            if (entry.second.type == type_)
+            {
+                return entry.second;
+            }
+        }
+
+        DIE << "Not a struct type.";
+        return structs.begin()->second;
+    }
+
+    int getFieldIndex(const StructLayout &layout, const std::string &fieldName)
+    {
+        for (auto i = 0; i < layout.fields.size(); i++)
+        {
+            if (layout.fields[i] == fieldName)
+            {
+                return i;
+            }
+        }
+
+        DIE << "Struct \"" << layout.type->getName().str() << "\" has no field \"" << fieldName << "\".";
+        return 0;
+    }
+
+    /**
+     * Struct layout for an SoA struct, its stack storage or view type
+     */
+    StructLayout *getSoALayout(llvm::Type *type_)
+    {
+        if (soaTypes.count(type_) != 0)
+        {
+            return soaTypes[type_];
+        }
+
+        for (auto &entry : structs)
+        {
+            if (entry.second.type == type_ && entry.second.soa)
+            {
+                return &entry.second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * length > 0: stack storage { [length x T1], ... }
+     * length == 0: view { T1*, ... }
+     */
+    llvm::StructType *getSoAType(StructLayout &layout, int length)
+    {
+        auto name = layout.type->getName().str() + ".soa" + (length > 0 ? "." + std::to_string(length) : "");
+
+        if (auto existing = llvm::StructType::getTypeByName(*ctx, name))
+        {
+            return existing;
+        }
+
+        std::vector<llvm::Type *> columnTypes{};
+
+        for (auto fieldType : layout.type->elements())
+        {
+            columnTypes.push_back(length > 0 ? (llvm::Type *)llvm::ArrayType::get(fieldType, length) : fieldType->getPointerTo());
+        }
+
+        auto soaType = llvm::StructType::create(*ctx, columnTypes, name);
+        soaTypes[soaType] = &layout;
+
+        return soaType;
+    }
+
+    bool isSoAStorage(llvm::Type *type_)
+    {
+        return getSoALayout(type_) != nullptr && type_->getStructElementType(0)->isArrayTy();
+    }
+
+    /**
+     * Stack storage alloca or view value of an SoA array expression,
+     * nullptr for other arrays.
+     */
+    llvm::Value *getSoAColumns(const Exp &arrayExp, Env env)
+    {
+        if (arrayExp.type == ExpType::SYMBOL)
+        {
+            auto binding = env->lookup(arrayExp.string);
+
+            if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(binding); localVar && isSoAStorage(localVar->getAllocatedType()))
+            {
+                return localVar;
+            }
+
+            auto bindingType = binding->getType()->getPointerElementType();
+
+            if (!bindingType->isStructTy() || getSoALayout(bindingType) == nullptr)
+            {
+                return nullptr;
+            }
+        }
+
+        auto columns = generate(arrayExp, env);
+
+        return getSoALayout(columns->getType()) != nullptr ? columns : nullptr;
+    }
+
+    llvm::Value *createSoAView(llvm::AllocaInst *storage)
+    {
+        auto &layout = *getSoALayout(storage->getAllocatedType());
+        auto viewType = getSoAType(layout, 0);
+        llvm::Value *view = llvm::UndefValue::get(viewType);
+
+        for (auto i = 0; i < layout.fields.size(); i++)
+        {
+            auto column = builder->CreateConstInBoundsGEP2_32(storage->getAllocatedType(), storage, 0, i);
+            view = builder->CreateInsertValue(view, builder->CreateConstInBoundsGEP2_32(column->getType()->getPointerElementType(), column, 0, 0), i, "tmpsoa");
+        }
+
+        return view;
+    }
+
+    /**
+     * Uninitialized buffer of `count` elements in the current region
+     */
+    llvm::Value *allocBuffer(llvm::Type *elemType, llvm::Value *count)
+    {
+        auto size = builder->CreateMul(count, llvm::ConstantExpr::getSizeOf(elemType), "tmpsize");
+        auto buffer = builder->CreateCall(module->getFunction("eva_region_alloc"), {size}, "tmpbuf");
+
+        return builder->CreateBitCast(buffer, elemType->getPointerTo(), "tmparray");
+    }
+
+    /**
+     * Self-referential loop ID with hint nodes, e.g.:
+     * !0 = distinct !{!0, !1}
+     * !1 = !{!"llvm.loop.vectorize.enable", i1 true}
+     *
+     * Hints without a value (nullptr) are emitted as a bare name,
+     * e.g. !{!"llvm.loop.unroll.full"}
+     */
+    llvm::MDNode *createLoopMetadata(const std::vector<std::pair<std::string, llvm::Constant *>> &hints)
+    {
+        std::vector<llvm::Metadata *> ops{nullptr};
+
+        for (auto &hint : hints)
+        {
+            if (hint.second == nullptr)
+            {
+                ops.push_back(llvm::MDNode::get(*ctx, {llvm::MDString::get(*ctx, hint.first)}));
+                continue;
+            }
+
+            ops.push_back(llvm::MDNode::get(*ctx, {llvm::MDString::get(*ctx, hint.first),
+                                                   llvm::ConstantAsMetadata::get(hint.second)}));
+        }
+
+        auto loopID = llvm::MDNode::getDistinct(*ctx, ops);
+        loopID->replaceOperandWith(0, loopID);
+
+        return loopID;
+    }
+
+    /**
+     * Numeric conversion between scalar types (int <-> float, widths)
+     */
+    llvm::Value *castValue(llvm::Value *value, llvm::Type *type_)
+    {
+        auto fromType = value->getType();
+        auto isNumeric = [](llvm::Type *t)
+        { return t->isIntOrIntVectorTy() || t->isFPOrFPVectorTy(); };
+
+        if (fromType == type_ || !isNumeric(fromType) || !isNumeric(type_))
+        {
+            return value;
+        }
+
+        if (fromType->isIntOrIntVectorTy() && type_->isFPOrFPVectorTy())
+        {
+            return builder->CreateSIToFP(value, type_, "tmpcast");
+        }
+
+        if (fromType->isFPOrFPVectorTy() && type_->isIntOrIntVectorTy())
+        {
+            return builder->CreateFPToSI(value, type_, "tmpcast");
+        }
+
+        if (fromType->isFPOrFPVectorTy())
+        {
+            return builder->CreateFPCast(value, type_, "tmpcast");
+        }
+
+        return builder->CreateSExtOrTrunc(value, type_, "tmpcast");
+    }
+
+    /**
+     * Checked arithmetic: llvm.s{add,sub,mul}.with.overflow,
+     * trapping when the overflow bit is set
+     */
+    llvm::Value *createCheckedOp(llvm::Intrinsic::ID id, llvm::Value *op1, llvm::Value *op2, const char *varName)
+    {
+        auto result = builder->CreateBinaryIntrinsic(id, op1, op2, nullptr, "tmpchecked");
+
+        trapIf(builder->CreateExtractValue(result, 1, "tmpoverflow"));
+
+        return builder->CreateExtractValue(result, 0, varName);
+    }
+
+    /**
+     * Division by zero & INT_MIN / -1
+     */
+    void checkDivision(llvm::Value *op1, llvm::Value *op2)
+    {
+        auto type = op1->getType();
+        auto byZero = builder->CreateICmpEQ(op2, llvm::Constant::getNullValue(type), "tmpdivzero");
+        auto overflow = builder->CreateAnd(
+            builder->CreateICmpEQ(op1, llvm::ConstantInt::get(type, llvm::APInt::getSignedMinValue(type->getIntegerBitWidth()))),
+            builder->CreateICmpEQ(op2, llvm::Constant::getAllOnesValue(type)),
+            "tmpdivoverflow");
+
+        trapIf(builder->CreateOr(byZero, overflow));
+    }
+
+    /**
+     * Continues in a new block; `cond` branches off to llvm.trap
+     */
+    void trapIf(llvm::Value *cond)
+    {
+        auto trapBlock = createBB("trap", fn);
+        auto contBlock = createBB("cont", fn);
+
+        auto branch = builder->CreateCondBr(cond, trapBlock, contBlock);
+        branch->setMetadata(llvm::LLVMContext::MD_prof, llvm::MDBuilder(*ctx).createBranchWeights(1, 1 << 20));
+
+        builder->SetInsertPoint(trapBlock);
+        builder->CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+        builder->CreateUnreachable();
+
+        builder->SetInsertPoint(contBlock);
+    }
+
+    /**
+     * Makes operands of a binary operation agree:
+     * a scalar next to a vector is converted & splatted,
+     * an integer next to a float is converted.
+     */
+    void coerceOperands(llvm::Value *&op1, llvm::Value *&op2)
+    {
+        auto type1 = op1->getType();
+        auto type2 = op2->getType();
+
+        if (type1 == type2)
+        {
+            return;
+        }
+
+        if (auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(type1); vecType && !type2->isVectorTy())
+        {
+            op2 = builder->CreateVectorSplat(vecType->getNumElements(), castValue(op2, vecType->getElementType()), "tmpsplat");
+        }
+        else if (auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(type2); vecType && !type1->isVectorTy())
+        {
+            op1 = builder->CreateVectorSplat(vecType->getNumElements(), castValue(op1, vecType->getElementType()), "tmpsplat");
+        }
+        else if (type2->isFloatingPointTy() && type1->isIntegerTy())
+        {
+            op1 = castValue(op1, type2);
+        }
+        // Pointer vs. 0, e.g. the end of a split string
+        else if (type1->isPointerTy() && type2->isIntegerTy())
+        {
+            op2 = builder->CreateIntToPtr(op2, type1, "tmpptr");
+        }
+        else if (type2->isPointerTy() && type1->isIntegerTy())
+        {
+            op1 = builder->CreateIntToPtr(op1, type2, "tmpptr");
+        }
+        else
+        {
+            op2 = castValue(op2, type1);
+        }
+    }
+
+    /**
+     * Builtin from the intrinsics table. Operands are coerced to one type
+     * (integers to f64 for FP-only intrinsics), so they also work
+     * element-wise on vectors.
+     */
+    llvm::Value *compileIntrinsic(const Exp &exp, Env env)
+    {
+        auto op = exp.list[0].string;
+        auto &builtin = intrinsicBuiltins.at(op);
+
+        if (exp.list.size() - 1 != builtin.arity)
+        {
+            DIE << "(" << op << ") expects " << builtin.arity << " arguments";
+        }
+
+        std::vector<llvm::Value *> args{};
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            args.push_back(generate(exp.list[i], env));
+        }
+
+        // (prefetch ptr): read, high locality, data cache
+        if (op == "prefetch")
+        {
+            auto ptr = builder->CreateBitCast(args[0], builder->getInt8PtrTy(), "tmpptr");
+
+            builder->CreateIntrinsic(llvm::Intrinsic::prefetch, {ptr->getType()}, {ptr, builder->getInt32(0), builder->getInt32(3), builder->getInt32(1)});
+
+            return builder->getInt32(0);
+        }
+
+        // (expect cond v): the expected value takes the condition's type
+        if (op == "expect")
+        {
+            auto expected = castValue(args[1], args[0]->getType());
+
+            if (expected->getType() != args[0]->getType() || !llvm::isa<llvm::Constant>(expected))
+            {
+                DIE << "(expect) needs a constant of the condition's type";
+            }
+
+            return builder->CreateIntrinsic(llvm::Intrinsic::expect, {args[0]->getType()}, {args[0], expected}, nullptr, "tmpexpect");
+        }
+
+        for (auto i = 1; i < args.size(); i++)
+        {
+            coerceOperands(args[0], args[i]);
+        }
+
+        for (auto i = 1; i < args.size(); i++)
+        {
+            args[i] = castValue(args[i], args[0]->getType());
+        }
+
+        auto type = args[0]->getType();
+        auto isFP = type->isFPOrFPVectorTy();
+
+        if (!isFP && builtin.intId == llvm::Intrinsic::not_intrinsic)
+        {
+            // FP-only: (sqrt 16)
+            auto fpType = type->isVectorTy() ? (llvm::Type *)llvm::VectorType::get(builder->getDoubleTy(), llvm::cast<llvm::VectorType>(type)) : builder->getDoubleTy();
+
+            for (auto &arg : args)
+            {
+                arg = castValue(arg, fpType);
+            }
+
+            type = fpType;
+            isFP = true;
+        }
+
+        auto id = isFP ? builtin.fpId : builtin.intId;
+
+        if (id == llvm::Intrinsic::not_intrinsic || (!type->isIntOrIntVectorTy() && !isFP))
+        {
+            DIE << "(" << op << ") is not defined for this operand type";
+        }
+
+        // Zero input is defined (returns the bit width); abs of INT_MIN isn't poison
+        if (id == llvm::Intrinsic::ctlz || id == llvm::Intrinsic::cttz || id == llvm::Intrinsic::abs)
+        {
+            args.push_back(builder->getFalse());
+        }
+
+        return builder->CreateIntrinsic(id, {type}, args, nullptr, "tmp" + op);
+    }
+
+    /**
+     * Lowers to llvm.vector.reduce.* intrinsics.
+     * FP add/mul are marked reassoc, so the reduction may be done as a tree.
+     */
+    llvm::Value *createReduction(const std::string &op, llvm::Value *vec)
+    {
+        auto elemType = vec->getType()->getScalarType();
+
+        if (elemType->isFloatingPointTy())
+        {
+            llvm::Value *result;
+
+            if (op == "reduce-add")
+            {
+                result = builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(elemType), vec);
+            }
+            else if (op == "reduce-mul")
+            {
+                result = builder->CreateFMulReduce(llvm::ConstantFP::get(elemType, 1.0), vec);
+            }
+            else if (op == "reduce-min")
+            {
+                return builder->CreateFPMinReduce(vec);
+            }
+            else
+            {
+                return builder->CreateFPMaxReduce(vec);
+            }
+
+            llvm::FastMathFlags flags;
+            flags.setAllowReassoc();
+            llvm::cast<llvm::Instruction>(result)->setFastMathFlags(flags);
+
+            return result;
+        }
+
+        if (op == "reduce-add")
+        {
+            return builder->CreateAddReduce(vec);
+        }
+
+        if (op == "reduce-mul")
+        {
+            return builder->CreateMulReduce(vec);
+        }
+
+        if (op == "reduce-min")
+        {
+            return builder->CreateIntMinReduce(vec, /* signed */ true);
+        }
+
+        return builder->CreateIntMaxReduce(vec, /* signed */ true);
+    }
+
+    bool hasReturnType(const Exp &fnExp)
+    {
+        return fnExp.list[3].type == ExpType::SYMBOL && fnExp.list[3].string == "->";
+    }
+
+    llvm::FunctionType *extractFunctionType(const Exp &fnExp)
+    {
+        auto params = fnExp.list[2];
+        auto returnType = hasReturnType(fnExp) ? getType(fnExp.list[4]) : builder->getInt32Ty();
+
+        std::vector<llvm::Type *> paramTypes{};
+
+        for (auto &param : params.list)
+        {
+            auto paramType = extractVarType(param);
+            paramTypes.push_back(paramType);
+        }
+
+        return llvm::FunctionType::get(returnType, paramTypes, false);
+    }
+
+    /**
+     * (and a b ...), (or a b ...)
+     *
+     * Cheap, side-effect free operands are evaluated unconditionally &
+     * combined with i1 and/or (no branch to mispredict). Any other operand
+     * is only evaluated when the ones before it don't decide the result.
+     */
+    llvm::Value *compileLogical(const Exp &exp, Env env)
+    {
+        auto isAnd = exp.list[0].string == "and";
+        auto result = toBool(generate(exp.list[1], env));
+
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            auto budget = 8;
+
+            if (isCheap(exp.list[i], budget))
+            {
+                auto operand = toBool(generate(exp.list[i], env));
+                result = isAnd ? builder->CreateAnd(result, operand, "tmpand") : builder->CreateOr(result, operand, "tmpor");
+                continue;
+            }
+
+            auto shortBlock = builder->GetInsertBlock();
+            auto rhsBlock = createBB("logicrhs", fn);
+            auto logicEndBlock = createBB("logicend");
+
+            if (isAnd)
+            {
+                builder->CreateCondBr(result, rhsBlock, logicEndBlock);
+            }
+            else
+            {
+                builder->CreateCondBr(result, logicEndBlock, rhsBlock);
+            }
+
+            builder->SetInsertPoint(rhsBlock);
+            auto operand = toBool(generate(exp.list[i], env));
+            builder->CreateBr(logicEndBlock);
+            rhsBlock = builder->GetInsertBlock();
+
+            fn->getBasicBlockList().push_back(logicEndBlock);
+            builder->SetInsertPoint(logicEndBlock);
+
+            auto phi = builder->CreatePHI(builder->getInt1Ty(), 2, isAnd ? "tmpand" : "tmpor");
+            phi->addIncoming(builder->getInt1(!isAnd), shortBlock);
+            phi->addIncoming(operand, rhsBlock);
+
+            result = phi;
+        }
+
+        return result;
+    }
+
+    /**
+     * Safe & cheap to evaluate speculatively: variables, literals and
+     * small arithmetic/logic on them. No calls, memory accesses
+     * (the guard may be a bounds check), division or checked arithmetic.
+     */
+    bool isCheap(const Exp &exp, int &budget)
+    {
+        if (--budget < 0)
+        {
+            return false;
+        }
+
+        if (exp.type != ExpType::LIST)
+        {
+            return true;
+        }
+
+        static const std::set<std::string> cheapOps = {
+            "+", "-", "*", "==", "!=", "<", ">", "<=", ">=", "and", "or", "not"};
+
+        if (exp.list[0].type != ExpType::SYMBOL || cheapOps.count(exp.list[0].string) == 0)
+        {
+            return false;
+        }
+
+        // Checked arithmetic traps, so it must stay behind its guard
+        if (options.checkedArithmetic && (exp.list[0].string == "+" || exp.list[0].string == "-" || exp.list[0].string == "*"))
+        {
+            return false;
+        }
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            if (!isCheap(exp.list[i], budget))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Truth value: non-zero numbers are true
+     */
+    llvm::Value *toBool(llvm::Value *value)
+    {
+        auto type = value->getType();
+
+        if (type->isIntegerTy(1))
+        {
+            return value;
+        }
+
+        if (type->isFloatingPointTy())
+        {
+            return builder->CreateFCmpUNE(value, llvm::ConstantFP::get(type, 0), "tmpbool");
+        }
+
+        return builder->CreateICmpNE(value, llvm::Constant::getNullValue(type), "tmpbool");
+    }
+
+    /**
+     * (switch x (1 e1) ((2 3) e2) (default e))
+     *
+     * A single switch instruction, which the backend turns into a jump
+     * table, a bit test or a binary search. Labels are integer literals;
+     * without a default the result is 0.
+     */
+    llvm::Value *compileSwitch(const Exp &exp, Env env)
+    {
+        auto value = generate(exp.list[1], env);
+
+        if (!value->getType()->isIntegerTy())
+        {
+            DIE << "switch: value must be an integer";
+        }
+
+        auto valueType = llvm::cast<llvm::IntegerType>(value->getType());
+
+        auto defaultBlock = createBB("switchdefault");
+        auto switchEndBlock = createBB("switchend");
+
+        auto switchInst = builder->CreateSwitch(value, defaultBlock, exp.list.size() - 2);
+
+        BranchResults results{};
+        const Exp *defaultExp = nullptr;
+
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            auto &label = exp.list[i].list[0];
+
+            if (label.type == ExpType::SYMBOL && label.string == "default")
+            {
+                defaultExp = &exp.list[i].list[1];
+                continue;
+            }
+
+            auto caseBlock = createBB("case", fn);
+            auto labels = label.type == ExpType::LIST ? label.list : std::vector<Exp>{label};
+
+            for (auto &caseLabel : labels)
+            {
+                if (caseLabel.type != ExpType::NUMBER)
+                {
+                    DIE << "switch: case labels must be integer literals";
+                }
+
+                auto caseValue = llvm::ConstantInt::get(valueType, caseLabel.number, /* signed */ true);
+
+                if (switchInst->findCaseValue(caseValue) != switchInst->case_default())
+                {
+                    DIE << "switch: duplicate case " << caseLabel.number;
+                }
+
+                switchInst->addCase(caseValue, caseBlock);
+            }
+
+            builder->SetInsertPoint(caseBlock);
+            addBranchResult(generate(exp.list[i].list[1], env), results, switchEndBlock);
+        }
+
+        fn->getBasicBlockList().push_back(defaultBlock);
+        builder->SetInsertPoint(defaultBlock);
+
+        return finishBranches(defaultExp, results, switchEndBlock, env);
+    }
+
+    /**
+     * (cond (test1 e1) (test2 e2) (else e))
+     *
+     * A chain of conditional branches; SimplifyCFG turns equality
+     * tests on the same value into a switch. Without else the result is 0.
+     */
+    llvm::Value *compileCond(const Exp &exp, Env env)
+    {
+        auto condEndBlock = createBB("condend");
+
+        BranchResults results{};
+        const Exp *elseExp = nullptr;
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            auto &test = exp.list[i].list[0];
+
+            if (test.type == ExpType::SYMBOL && test.string == "else")
+            {
+                elseExp = &exp.list[i].list[1];
+                break;
+            }
+
+            auto cond = generate(test, env);
+
+            auto thenBlock = createBB("condthen", fn);
+            auto nextBlock = createBB("condnext");
+
+            builder->CreateCondBr(cond, thenBlock, nextBlock);
+
+            builder->SetInsertPoint(thenBlock);
+            addBranchResult(generate(exp.list[i].list[1], env), results, condEndBlock);
+
+            fn->getBasicBlockList().push_back(nextBlock);
+            builder->SetInsertPoint(nextBlock);
+        }
+
+        return finishBranches(elseExp, results, condEndBlock, env);
+    }
+
+    /**
+     * Converts a branch result to the type of the first one
+     * & jumps to the end block
+     */
+    void addBranchResult(llvm::Value *value, BranchResults &results, llvm::BasicBlock *endBlock)
+    {
+        if (!results.empty())
+        {
+            value = castValue(value, results[0].first->getType());
+        }
+
+        builder->CreateBr(endBlock);
+
+        // Nested branches may have moved the insert block
+        results.push_back({value, builder->GetInsertBlock()});
+    }
+
+    /**
+     * Generates the fallback branch in the current block, then joins
+     * all results in a phi at the end block
+     */
+    llvm::Value *finishBranches(const Exp *fallbackExp, BranchResults &results, llvm::BasicBlock *endBlock, Env env)
+    {
+        llvm::Value *fallback;
+
+        if (fallbackExp != nullptr)
+        {
+            fallback = generate(*fallbackExp, env);
+        }
+        else
+        {
+            fallback = results.empty() ? (llvm::Value *)builder->getInt32(0) : llvm::Constant::getNullValue(results[0].first->getType());
+        }
+
+        addBranchResult(fallback, results, endBlock);
+
+        fn->getBasicBlockList().push_back(endBlock);
+        builder->SetInsertPoint(endBlock);
+
+        auto phi = builder->CreatePHI(results[0].first->getType(), results.size(), "tmpbranch");
+
+        for (auto &result : results)
+        {
+            phi->addIncoming(result.first, result.second);
+        }
+
+        return phi;
+    }
+
+    /**
+     * --instrument: counters of the current function, starts its timer.
+     *
+     * Self time: each function adds its elapsed cycles to a global
+     * callee-cycles counter that its caller subtracts.
+     */
+    ProfileScope beginProfile()
+    {
+        if (!options.instrument)
+        {
+            return {};
+        }
+
+        auto probe = addProfileProbe(fn->getName().str(), false);
+        auto calleeCycles = getCalleeCycles();
+        auto i64 = builder->getInt64Ty();
+
+        incrementCounter(probe->count, builder->getInt64(1));
+
+        auto outer = builder->CreateLoad(i64, calleeCycles, "profouter");
+        builder->CreateStore(builder->getInt64(0), calleeCycles);
+
+        auto start = builder->CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "profstart");
+
+        return {probe, start, outer};
+    }
+
+    /**
+     * Stops the timer; call right before the return
+     */
+    void endProfile(const ProfileScope &scope)
+    {
+        if (scope.probe == nullptr)
+        {
+            return;
+        }
+
+        auto calleeCycles = getCalleeCycles();
+        auto i64 = builder->getInt64Ty();
+
+        auto end = builder->CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "profend");
+        auto elapsed = builder->CreateSub(end, scope.start, "profelapsed");
+        auto inCallees = builder->CreateLoad(i64, calleeCycles, "profcallees");
+
+        incrementCounter(scope.probe->cycles, elapsed);
+        incrementCounter(scope.probe->selfCycles, builder->CreateSub(elapsed, inCallees));
+
+        // The caller's callees now include this call
+        builder->CreateStore(builder->CreateAdd(scope.outerCalleeCycles, elapsed), calleeCycles);
+    }
+
+    /**
+     * --instrument: counts the iterations of the loop whose body starts here
+     */
+    void countLoopIteration(const std::string &kind)
+    {
+        if (!options.instrument)
+        {
+            return;
+        }
+
+        auto loops = 0;
+
+        for (auto &probe : profileProbes)
+        {
+            loops += probe.isLoop && probe.name.rfind(fn->getName().str() + "/", 0) == 0;
+        }
+
+        auto probe = addProfileProbe(fn->getName().str() + "/" + kind + " #" + std::to_string(loops + 1), true);
+
+        incrementCounter(probe->count, builder->getInt64(1));
+    }
+
+    ProfileProbe *addProfileProbe(const std::string &name, bool isLoop)
+    {
+        auto index = std::to_string(profileProbes.size());
+
+        auto counter = [&](const std::string &kind)
+        {
+            return new llvm::GlobalVariable(*module, builder->getInt64Ty(), false, llvm::GlobalVariable::InternalLinkage,
+                                            builder->getInt64(0), "prof." + kind + "." + index);
+        };
+
+        profileProbes.push_back({name, isLoop, counter("count"), counter("cycles"), counter("self")});
+
+        return &profileProbes.back();
+    }
+
+    // Plain (non-atomic) update: cheap, but parallel-for bodies may lose counts
+    void incrementCounter(llvm::GlobalVariable *counter, llvm::Value *amount)
+    {
+        auto value = builder->CreateLoad(builder->getInt64Ty(), counter, "profcount");
+        builder->CreateStore(builder->CreateAdd(value, amount), counter);
+    }
+
+    llvm::GlobalVariable *getCalleeCycles()
+    {
+        auto calleeCycles = module->getNamedGlobal("prof.callees");
+
+        if (calleeCycles == nullptr)
+        {
+            calleeCycles = new llvm::GlobalVariable(*module, builder->getInt64Ty(), false, llvm::GlobalVariable::InternalLinkage,
+                                                    builder->getInt64(0), "prof.callees");
+        }
+
+        return calleeCycles;
+    }
+
+    /**
+     * Passes the table of all probes to the runtime (runtime/Profile.cpp),
+     * which prints the profile. Emitted at the end of main: the counters
+     * may live in JIT memory, gone by the time atexit handlers run.
+     */
+    void reportProfile()
+    {
+        auto i64 = builder->getInt64Ty();
+        auto i64Ptr = i64->getPointerTo();
+        auto entryType = llvm::StructType::create(*ctx, {builder->getInt8PtrTy(), i64, i64Ptr, i64Ptr, i64Ptr}, "prof.entry");
+
+        std::vector<llvm::Constant *> entries{};
+
+        for (auto &probe : profileProbes)
+        {
+            entries.push_back(llvm::ConstantStruct::get(entryType, {builder->CreateGlobalStringPtr(probe.name, "prof.name"),
+                                                                    builder->getInt64(probe.isLoop),
+                                                                    probe.count, probe.cycles, probe.selfCycles}));
+        }
+
+        auto tableType = llvm::ArrayType::get(entryType, entries.size());
+        auto table = new llvm::GlobalVariable(*module, tableType, true, llvm::GlobalVariable::InternalLinkage,
+                                              llvm::ConstantArray::get(tableType, entries), "prof.table");
+
+        builder->CreateCall(module->getFunction("eva_profile_report"),
+                            {builder->CreateBitCast(table, builder->getInt8PtrTy()), builder->getInt64(entries.size())});
+    }
+
+    /**
+     * Untyped: (def square (x) (* x x)) - i32 by default
+     * Typed: (def square ((x number)) -> number (* x x))
+     */
+    llvm::Value *compileFunction(const Exp &fnExp, Env env)
+    {
+        auto fnName = fnExp.list[1].string;
+        auto params = fnExp.list[2];
+        auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+        // Save current fn
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+
+        // Override fn to compile body
+        auto newFn = createFunction(fnName, extractFunctionType(fnExp), env);
+        fn = newFn;
+
+        auto fnEnv = createParamBindings(params, env);
+
+        auto profile = beginProfile();
+        auto result = generate(body, fnEnv);
+        endProfile(profile);
+
+        builder->CreateRet(result);
+
+        builder->SetInsertPoint(prevBlock);
+        // Restore
+        fn = prevFn;
+
+        if (isPureFunction(fnName, params, body))
+        {
+            pureFunctions.insert(fnName);
+        }
+
+        return newFn;
+    }
+
+    /**
+     * (defmemo (name capacity policy) (params) <body>)
+     *
+     * `name` checks a direct-mapped cache keyed on the argument tuple &
+     * only calls `name.impl` (the body) on a miss. Recursive calls go
+     * through `name`, so e.g. Fibonacci becomes linear.
+     *
+     * capacity: number of entries, rounded up to a power of 2 (1024)
+     * policy: on a collision `replace` the entry (default), or `keep` it
+     *
+     * The body must be pure & the params scalar. The cache isn't
+     * synchronized, so don't call it from parallel-for.
+     */
+    llvm::Value *compileMemoFunction(const Exp &fnExp, Env env)
+    {
+        auto nameDecl = fnExp.list[1];
+        auto fnName = extractVarName(nameDecl);
+        auto params = fnExp.list[2];
+        auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+        uint64_t capacity = 1024;
+        auto keepOld = false;
+
+        if (nameDecl.type == ExpType::LIST && nameDecl.list.size() > 1)
+        {
+            capacity = std::max<uint64_t>(llvm::PowerOf2Ceil(nameDecl.list[1].number), 2);
+        }
+
+        if (nameDecl.type == ExpType::LIST && nameDecl.list.size() > 2)
+        {
+            auto policy = nameDecl.list[2].string;
+
+            if (policy != "replace" && policy != "keep")
+            {
+                DIE << "defmemo " << fnName << ": unknown eviction policy " << policy;
+            }
+
+            keepOld = policy == "keep";
+        }
+
+        if (!isPureFunction(fnName, params, body))
+        {
+            DIE << "defmemo " << fnName << ": function is not pure";
+        }
+
+        auto fnType = extractFunctionType(fnExp);
+
+        for (auto paramType : fnType->params())
+        {
+            if (!paramType->isIntegerTy() && !paramType->isFloatingPointTy())
+            {
+                DIE << "defmemo " << fnName << ": only number params can be cache keys";
+            }
+        }
+
+        // Cache entry: {valid, params..., result}
+        std::vector<llvm::Type *> entryFields{builder->getInt1Ty()};
+        entryFields.insert(entryFields.end(), fnType->param_begin(), fnType->param_end());
+        entryFields.push_back(fnType->getReturnType());
+
+        auto entryType = llvm::StructType::create(*ctx, entryFields, fnName + ".memo.entry");
+        auto cacheType = llvm::ArrayType::get(entryType, capacity);
+        auto cache = new llvm::GlobalVariable(*module, cacheType, false, llvm::GlobalVariable::InternalLinkage,
+                                              llvm::ConstantAggregateZero::get(cacheType), fnName + ".memo");
+
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+
+        // The cached entry point is defined first, so the body recurses through it
+        auto memoFn = createFunction(fnName, fnType, env);
+        auto implFn = createFunction(fnName + ".impl", fnType, env);
+        implFn->setLinkage(llvm::Function::InternalLinkage);
+        fn = implFn;
+
+        auto fnEnv = createParamBindings(params, env);
+
+        auto profile = beginProfile();
+        auto implResult = generate(body, fnEnv);
+        endProfile(profile);
+
+        builder->CreateRet(implResult);
+
+        fn = memoFn;
+        builder->SetInsertPoint(&memoFn->getEntryBlock());
+        resetDebugLocation(memoFn);
+
+        std::vector<llvm::Value *> args{};
+
+        for (auto &arg : memoFn->args())
+        {
+            arg.setName(extractVarName(params.list[arg.getArgNo()]));
+            args.push_back(&arg);
+        }
+
+        // Fibonacci hashing of the combined keys
+        llvm::Value *hash = builder->getInt64(0);
+
+        for (auto arg : args)
+        {
+            hash = builder->CreateMul(builder->CreateXor(hash, memoKey(arg)), builder->getInt64(0x9E3779B97F4A7C15), "tmphash");
+        }
+
+        auto index = builder->CreateLShr(hash, 64 - llvm::Log2_64(capacity), "tmpslot");
+        auto slot = builder->CreateInBoundsGEP(cacheType, cache, {builder->getInt64(0), index}, "tmpentry");
+
+        llvm::Value *hit = builder->CreateLoad(builder->getInt1Ty(), builder->CreateStructGEP(entryType, slot, 0), "tmpvalid");
+
+        for (auto i = 0; i < args.size(); i++)
+        {
+            auto cached = builder->CreateLoad(args[i]->getType(), builder->CreateStructGEP(entryType, slot, i + 1), "tmpkey");
+            hit = builder->CreateAnd(hit, builder->CreateICmpEQ(memoKey(cached), memoKey(args[i])), "tmphit");
+        }
+
+        auto hitBlock = createBB("memohit", memoFn);
+        auto missBlock = createBB("memomiss", memoFn);
+
+        builder->CreateCondBr(hit, hitBlock, missBlock);
+
+        builder->SetInsertPoint(hitBlock);
+        auto resultIndex = args.size() + 1;
+        builder->CreateRet(builder->CreateLoad(fnType->getReturnType(), builder->CreateStructGEP(entryType, slot, resultIndex), "tmpcached"));
+
+        builder->SetInsertPoint(missBlock);
+        auto result = builder->CreateCall(implFn, args, "tmpresult");
+
+        if (keepOld)
+        {
+            auto valid = builder->CreateLoad(builder->getInt1Ty(), builder->CreateStructGEP(entryType, slot, 0), "tmpvalid");
+            auto storeBlock = createBB("memostore", memoFn);
+            auto retBlock = createBB("memoret", memoFn);
+
+            builder->CreateCondBr(valid, retBlock, storeBlock);
+
+            builder->SetInsertPoint(retBlock);
+            builder->CreateRet(result);
+
+            builder->SetInsertPoint(storeBlock);
+        }
+
+        builder->CreateStore(builder->getTrue(), builder->CreateStructGEP(entryType, slot, 0));
+
+        for (auto i = 0; i < args.size(); i++)
+        {
+            builder->CreateStore(args[i], builder->CreateStructGEP(entryType, slot, i + 1));
+        }
+
+        builder->CreateStore(result, builder->CreateStructGEP(entryType, slot, resultIndex));
+        builder->CreateRet(result);
+
+        builder->SetInsertPoint(prevBlock);
+        fn = prevFn;
+
+        pureFunctions.insert(fnName);
+
+        return memoFn;
+    }
+
+    /**
+     * Bits of a scalar as i64, so floats compare & hash by representation
+     */
+    llvm::Value *memoKey(llvm::Value *value)
+    {
+        auto type = value->getType();
+
+        if (type->isFloatingPointTy())
+        {
+            value = builder->CreateBitCast(value, builder->getIntNTy(type->getPrimitiveSizeInBits()), "tmpbits");
+        }
+
+        return builder->CreateZExtOrTrunc(value, builder->getInt64Ty(), "tmpkey");
+    }
+
+    bool isPureFunction(const std::string &fnName, const Exp &params, const Exp &body)
+    {
+        std::set<std::string> locals{};
+
+        for (auto &param : params.list)
+        {
+            locals.insert(extractVarName(param));
+        }
+
+        return isPure(body, locals, fnName);
+    }
+
+    /**
+     * Pure: the result only depends on the arguments, and there are no
+     * effects besides writes to own locals. Calls may only go to other
+     * pure functions or to `self` (recursion).
+     */
+    bool isPure(const Exp &exp, std::set<std::string> &locals, const std::string &self)
+    {
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+        case ExpType::STRING:
+            return true;
+
+        case ExpType::SYMBOL:
+            // Globals may change between calls
+            return locals.count(exp.string) != 0 || exp.string == "true" || exp.string == "false";
+
+        case ExpType::LIST:
+            break;
+        }
+
+        if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL)
+        {
+            return false;
+        }
+
+        static const std::set<std::string> effects = {
+            "printf", "print-int", "print-str", "print-f64", "print-char", "flush",
+            "def", "defmemo", "defasync", "struct", "await", "yield", "parallel-for",
+            "make-array", "str-concat", "str-split", "prefetch"};
+
+        auto op = exp.list[0].string;
+        auto args = [&](size_t from)
+        {
+            for (auto i = from; i < exp.list.size(); i++)
+            {
+                if (!isPure(exp.list[i], locals, self))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        if (effects.count(op) != 0)
+        {
+            return false;
+        }
+
+        if (op == "var")
+        {
+            locals.insert(extractVarName(exp.list[1]));
+
+            return args(2);
+        }
+
+        // Only own variables can be assigned
+        if (op == "set")
+        {
+            return exp.list[1].type == ExpType::SYMBOL && args(1);
+        }
+
+        // Type operand
+        if (op == "vector" || op == "splat")
+        {
+            return args(2);
+        }
+
+        if (op == "field")
+        {
+            return isPure(exp.list[1], locals, self);
+        }
+
+        // (for (i start end step) hints... body)
+        if (op == "for")
+        {
+            auto header = exp.list[1];
+            locals.insert(header.list[0].string);
+
+            for (auto i = 1; i < header.list.size(); i++)
+            {
+                if (!isPure(header.list[i], locals, self))
+                {
+                    return false;
+                }
+            }
+
+            return isPure(exp.list[exp.list.size() - 1], locals, self);
+        }
 
-                    auto varName = exp.list[1].string;
-                    auto varBinding = env->lookup(varName);
+        // Function calls
+        if (module->getFunction(op) != nullptr || op == self)
+        {
+            return (op == self || pureFunctions.count(op) != 0) && args(1);
+        }
 
-                    builder->CreateStore(value, varBinding);
+        // Other builtins & struct constructors
+        return args(1);
+    }
 
-                    return value;
-                }
-                // Blocks: (begin <expression>)
-                else if (op == "begin")
-                {
-                    auto blockEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
+    /**
+     * (printf "x: %d, s: %s\n" x s)
+     *
+     * A literal format is split at compile time into typed runtime calls:
+     *   eva_print_strn("x: ", 3), eva_print_int(x), eva_print_strn(", s: ", 5), ...
+     * Formats with other conversions, flags or widths go through eva_printf.
+     * Returns the number of characters written.
+     */
+    llvm::Value *compilePrintf(const Exp &exp, Env env)
+    {
+        std::vector<llvm::Value *> args{};
 
-                    llvm::Value *blockResult;
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            args.push_back(generate(exp.list[i], env));
+        }
 
-                    for (auto i = 1; i < exp.list.size(); i++)
-                    {
-                        blockResult = generate(exp.list[i], blockEnv);
-                    }
+        std::vector<std::pair<char, std::string>> pieces{};
 
-                    return blockResult;
-                }
-                // printf(): (printf "Value: %d" 42)
-                else if (op == "printf")
-                {
-                    auto printFn = module->getFunction("printf");
-                    std::vector<llvm::Value *> args{};
+        if (exp.list[1].type == ExpType::STRING && splitFormat(unescapeString(exp.list[1].string), pieces, args.size()))
+        {
+            llvm::Value *written = builder->getInt32(0);
+            auto argIndex = 0;
 
-                    for (auto i = 1; i < exp.list.size(); i++)
-                    {
-                        args.push_back(generate(exp.list[i], env));
-                    }
+            for (auto &piece : pieces)
+            {
+                llvm::Value *count;
 
-                    return builder->CreateCall(printFn, args);
+                if (piece.first == 0)
+                {
+                    auto text = builder->CreateGlobalStringPtr(piece.second);
+                    count = builder->CreateCall(module->getFunction("eva_print_strn"), {text, builder->getInt64(piece.second.size())});
                 }
-                // Function calls
                 else
                 {
-                    auto callable = generate(exp.list[0], env);
-
-                    std::vector<llvm::Value *> args{};
-
-                    for (auto i = 1; i < exp.list.size(); i++)
-                    {
-                        args.push_back(generate(exp.list[i], env));
-                    }
-
-                    auto fn = (llvm::Function *)callable;
+                    auto printFn = module->getFunction(piece.first == 's'   ? "eva_print_str"
+                                                       : piece.first == 'f' ? "eva_print_f64"
+                                                       : piece.first == 'c' ? "eva_print_char"
+                                                                            : "eva_print_int");
 
-                    return builder->CreateCall(fn, args);
+                    count = builder->CreateCall(printFn, {castPrintArg(args[argIndex++], printFn->getArg(0)->getType())});
                 }
+
+                written = builder->CreateAdd(written, count, "tmpwritten");
             }
-        }
 
-        // Unreachable
-        return builder->getInt32(0);
-    }
+            return written;
+        }
 
-    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init)
-    {
-        module->getOrInsertGlobal(name, init->getType());
-        auto variable = module->getNamedGlobal(name);
-        variable->setAlignment(llvm::MaybeAlign(4));
-        variable->setConstant(false);
-        variable->setInitializer(init);
+        args.insert(args.begin(), generate(exp.list[1], env));
 
-        return variable;
+        return builder->CreateCall(module->getFunction("eva_printf"), args);
     }
 
     /**
-     * Functions consist of:
-     * - Function type: Param types / return type / varargs?
-     * - Blocks; always there: entry block
-     *     - Optimization takes place here
-     * - Control flow blocks: Branch instructions: Conditionals, jumps
+     * "a: %d%%\n" -> [(0, "a: "), ('d', ""), (0, "%\n")]
+     * False if the format needs the runtime formatter, or doesn't
+     * match the number of arguments.
      */
-    llvm::Function *createFunction(const std::string &fnName, llvm::FunctionType *fnType, Env env)
+    bool splitFormat(const std::string &format, std::vector<std::pair<char, std::string>> &pieces, int argCount)
     {
-        // Function prototype might already be defined
-        auto fn = module->getFunction(fnName);
+        std::string text = "";
+        auto conversions = 0;
 
-        if (fn == nullptr)
+        for (auto i = 0; i < format.size(); i++)
         {
-            fn = createFunctionProto(fnName, fnType, env);
-        }
+            if (format[i] != '%')
+            {
+                text += format[i];
+                continue;
+            }
 
-        createFunctionBlock(fn);
+            if (++i == format.size())
+            {
+                return false;
+            }
 
-        return fn;
-    }
+            auto conversion = format[i];
 
-    llvm::Function *createFunctionProto(const std::string &fnName, llvm::FunctionType *fnType, Env env)
-    {
-        auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage, fnName, *module);
+            if (conversion == '%')
+            {
+                text += '%';
+                continue;
+            }
 
-        verifyFunction(*fn);
+            if (std::string("dicsf").find(conversion) == std::string::npos)
+            {
+                return false;
+            }
 
-        env->define(fnName, fn);
+            if (!text.empty())
+            {
+                pieces.push_back({0, text});
+                text = "";
+            }
 
-        return fn;
-    }
+            pieces.push_back({conversion == 'i' ? 'd' : conversion, ""});
+            conversions++;
+        }
 
-    void createFunctionBlock(llvm::Function *fn)
-    {
-        auto entry = createBB("entry", fn);
-        // Emit code exactly into this block
-        builder->SetInsertPoint(entry);
+        if (!text.empty())
+        {
+            pieces.push_back({0, text});
+        }
+
+        return conversions == argCount;
     }
 
-    std::string extractVarName(const Exp &exp)
+    /**
+     * Booleans print as 0/1, other numbers are converted
+     */
+    llvm::Value *castPrintArg(llvm::Value *value, llvm::Type *type_)
     {
-        return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
+        if (value->getType()->isIntegerTy(1))
+        {
+            return builder->CreateZExt(value, type_, "tmpbool");
+        }
+
+        return castValue(value, type_);
     }
 
-    // Default: i32
-    llvm::Type *extractVarType(const Exp &exp)
+    std::string unescapeString(const std::string &str)
     {
-        return exp.type == ExpType::LIST ? getTypeFromString(exp.list[1].string) : builder->getInt32Ty();
+        auto re = std::regex("\\\\n");
+
+        return std::regex_replace(str, re, "\n");
     }
 
-    llvm::Type *getTypeFromString(const std::string &type_)
+    /**
+     * Binds arguments of the current function in a new environment
+     */
+    Env createParamBindings(const Exp &params, Env env)
     {
-        if (type_ == "number")
-        {
-            return builder->getInt32Ty();
-        }
+        auto index = 0;
+        auto fnEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
 
-        if (type_ == "string")
+        setArrayParamAttrs(fn, params);
+
+        for (auto &arg : fn->args())
         {
-            // aka char*
-            return builder->getInt8Ty()->getPointerTo();
+            auto param = params.list[index++];
+            auto argName = extractVarName(param);
+
+            arg.setName(argName);
+
+            // Allocate a local variable per argument to make arguments mutable
+            auto argBinding = allocVar(argName, arg.getType(), fnEnv);
+            builder->CreateStore(&arg, argBinding);
         }
 
-        // Default
-        return builder->getInt32Ty();
+        return fnEnv;
     }
 
-    bool hasReturnType(const Exp &fnExp)
+    /**
+     * Array buffer parameters are noalias: the arrays a function gets
+     * must not overlap. Passing the same variable twice is rejected by
+     * checkDistinctArrays; aliases made through other variables aren't
+     * tracked, & calls with them are undefined.
+     */
+    void setArrayParamAttrs(llvm::Function *function, const Exp &params)
     {
-        return fnExp.list[3].type == ExpType::SYMBOL && fnExp.list[3].string == "->";
+        for (auto &arg : function->args())
+        {
+            auto param = params.list[arg.getArgNo()];
+
+            if (isArrayType(param.type == ExpType::LIST ? param.list[1] : param) && arg.getType()->isPointerTy())
+            {
+                arg.addAttr(llvm::Attribute::NoAlias);
+            }
+        }
     }
 
-    llvm::FunctionType *extractFunctionType(const Exp &fnExp)
+    /**
+     * (f a a) for array parameters of f
+     */
+    void checkDistinctArrays(const Exp &callExp, llvm::Function *callee, const std::vector<llvm::Value *> &args)
     {
-        auto params = fnExp.list[2];
-        auto returnType = hasReturnType(fnExp) ? getTypeFromString(fnExp.list[4].string) : builder->getInt32Ty();
+        for (auto i = 0; i < args.size() && i < callee->arg_size(); i++)
+        {
+            for (auto j = i + 1; j < args.size() && j < callee->arg_size(); j++)
+            {
+                if (!callee->hasParamAttribute(i, llvm::Attribute::NoAlias) || !callee->hasParamAttribute(j, llvm::Attribute::NoAlias))
+                {
+                    continue;
+                }
 
-        std::vector<llvm::Type *> paramTypes{};
+                auto &a = callExp.list[i + 1];
+                auto &b = callExp.list[j + 1];
 
-        for (auto &param : params.list)
-        {
-            auto paramType = extractVarType(param);
-            paramTypes.push_back(paramType);
+                if (args[i] == args[j] || (a.type == ExpType::SYMBOL && b.type == ExpType::SYMBOL && a.string == b.string))
+                {
+                    DIE << "Array \"" << (a.type == ExpType::SYMBOL ? a.string : "argument") << "\" passed twice to \""
+                        << callee->getName().str() << "\": array parameters must not overlap.";
+                }
+            }
         }
-
-        return llvm::FunctionType::get(returnType, paramTypes, false);
     }
 
     /**
-     * Untyped: (def square (x) (* x x)) - i32 by default
-     * Typed: (def square ((x number)) -> number (* x x))
+     * (defasync fetch (id) <body>)
+     * (defasync fetch (id) -> number <body>)
+     *
+     * Switch-resumed coroutine (llvm.coro.*, split by the CoroSplit pass).
+     * Calling it runs the body up to the first suspension & returns the
+     * coroutine handle (a task). The number result stays in the promise
+     * until the task is awaited. The frame is malloc'ed unless CoroElide
+     * proves it doesn't outlive the caller.
      */
-    llvm::Value *compileFunction(const Exp &fnExp, Env env)
+    llvm::Value *compileAsyncFunction(const Exp &fnExp, Env env)
     {
         auto fnName = fnExp.list[1].string;
-        auto params = fnExp.list[2];
         auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
 
-        // Save current fn
+        // The promise holds the task's result
+        auto resultType = getPromiseType()->getElementType(1);
+
+        if (hasReturnType(fnExp) && getType(fnExp.list[4]) != resultType)
+        {
+            DIE << "Async function \"" << fnName << "\" must return number: tasks hold a number result.";
+        }
+
         auto prevFn = fn;
         auto prevBlock = builder->GetInsertBlock();
+        auto prevCoro = coro;
 
-        // Override fn to compile body
-        auto newFn = createFunction(fnName, extractFunctionType(fnExp), env);
+        auto bytePtrTy = builder->getInt8PtrTy();
+        auto fnType = llvm::FunctionType::get(bytePtrTy, extractFunctionType(fnExp)->params(), false);
+        auto newFn = createFunction(fnName, fnType, env);
         fn = newFn;
 
-        auto index = 0;
-        auto fnEnv = std::make_shared<Environment>(std::map<std::string, llvm::Value *>{}, env);
+        // Tells the coroutine passes to split this function
+        fn->addFnAttr("coroutine.presplit", "0");
 
-        for (auto &arg : fn->args())
-        {
-            auto param = params.list[index++];
-            auto argName = extractVarName(param);
+        // Prologue: id, (maybe elided) frame allocation, begin
+        setVarsInsertPoint();
+        auto promise = varsBuilder->CreateAlloca(getPromiseType(), 0, "promise");
 
-            arg.setName(argName);
+        auto nullPtr = llvm::ConstantPointerNull::get(bytePtrTy);
+        auto id = builder->CreateIntrinsic(llvm::Intrinsic::coro_id, {},
+                                           {builder->getInt32(0), builder->CreateBitCast(promise, bytePtrTy), nullPtr, nullPtr}, nullptr, "id");
+        auto needAlloc = builder->CreateIntrinsic(llvm::Intrinsic::coro_alloc, {}, {id}, nullptr, "needalloc");
 
-            // Allocate a local variable per argument to make arguments mutable
-            auto argBinding = allocVar(argName, arg.getType(), fnEnv);
-            builder->CreateStore(&arg, argBinding);
-        }
+        auto entryBlock = builder->GetInsertBlock();
+        auto allocBlock = createBB("coro.alloc", fn);
+        auto beginBlock = createBB("coro.begin", fn);
+        builder->CreateCondBr(needAlloc, allocBlock, beginBlock);
+
+        builder->SetInsertPoint(allocBlock);
+        auto frameSize = builder->CreateIntrinsic(llvm::Intrinsic::coro_size, {builder->getInt64Ty()}, {}, nullptr, "framesize");
+        auto frameMem = builder->CreateCall(module->getFunction("malloc"), {frameSize}, "framemem");
+        builder->CreateBr(beginBlock);
 
-        builder->CreateRet(generate(body, fnEnv));
+        builder->SetInsertPoint(beginBlock);
+        auto mem = builder->CreatePHI(bytePtrTy, 2, "mem");
+        mem->addIncoming(nullPtr, entryBlock);
+        mem->addIncoming(frameMem, allocBlock);
+        auto handle = builder->CreateIntrinsic(llvm::Intrinsic::coro_begin, {}, {id, mem}, nullptr, "handle");
+
+        // No awaiter yet
+        builder->CreateStore(nullPtr, builder->CreateStructGEP(getPromiseType(), promise, 0));
+
+        coro = {handle, promise, createBB("coro.cleanup"), createBB("coro.suspend")};
+
+        auto fnEnv = createParamBindings(fnExp.list[2], env);
+        auto result = generate(body, fnEnv);
+
+        // Publish the result & wake up the awaiting task
+        builder->CreateStore(castValue(result, resultType), builder->CreateStructGEP(getPromiseType(), promise, 1));
+        auto waiter = builder->CreateLoad(bytePtrTy, builder->CreateStructGEP(getPromiseType(), promise, 0), "waiter");
+        builder->CreateCall(module->getFunction("eva_schedule"), {waiter});
+
+        // Final suspension: the frame stays alive until the awaiter destroys it
+        createSuspend(/* final */ true);
+        builder->CreateUnreachable();
+
+        fn->getBasicBlockList().push_back(coro.cleanupBlock);
+        builder->SetInsertPoint(coro.cleanupBlock);
+        auto freeMem = builder->CreateIntrinsic(llvm::Intrinsic::coro_free, {}, {id, handle}, nullptr, "freemem");
+        builder->CreateCall(module->getFunction("free"), {freeMem});
+        builder->CreateBr(coro.suspendBlock);
+
+        fn->getBasicBlockList().push_back(coro.suspendBlock);
+        builder->SetInsertPoint(coro.suspendBlock);
+        builder->CreateIntrinsic(llvm::Intrinsic::coro_end, {}, {handle, builder->getFalse()});
+        builder->CreateRet(handle);
 
         builder->SetInsertPoint(prevBlock);
-        // Restore
         fn = prevFn;
+        coro = prevCoro;
 
         return newFn;
     }
 
+    /**
+     * Suspends the running coroutine. Code emitted afterwards runs
+     * once it is resumed.
+     */
+    void createSuspend(bool final)
+    {
+        auto state = builder->CreateIntrinsic(llvm::Intrinsic::coro_suspend, {},
+                                              {llvm::ConstantTokenNone::get(*ctx), builder->getInt1(final)}, nullptr, "suspend");
+
+        auto resumeBlock = createBB(final ? "coro.final" : "resume", fn);
+
+        // 0: resumed, 1: destroyed, -1 (default): suspended, return to the caller
+        auto dispatch = builder->CreateSwitch(state, coro.suspendBlock, 2);
+        dispatch->addCase(builder->getInt8(0), resumeBlock);
+        dispatch->addCase(builder->getInt8(1), coro.cleanupBlock);
+
+        builder->SetInsertPoint(resumeBlock);
+    }
+
+    /**
+     * (await task)
+     *
+     * In a coroutine: suspends until the task has finished.
+     * Elsewhere: runs the event loop until the task has finished.
+     * Reads the task's result & destroys it.
+     */
+    llvm::Value *compileAwait(const Exp &awaitExp, Env env)
+    {
+        auto task = generate(awaitExp.list[1], env);
+        auto taskPromise = builder->CreateBitCast(
+            builder->CreateIntrinsic(llvm::Intrinsic::coro_promise, {}, {task, builder->getInt32(8), builder->getFalse()}),
+            getPromiseType()->getPointerTo(), "taskpromise");
+
+        if (coro.handle == nullptr)
+        {
+            builder->CreateCall(module->getFunction("eva_await"), {task});
+        }
+        else
+        {
+            auto done = builder->CreateIntrinsic(llvm::Intrinsic::coro_done, {}, {task}, nullptr, "done");
+            auto waitBlock = createBB("await", fn);
+            auto readyBlock = createBB("ready");
+            builder->CreateCondBr(done, readyBlock, waitBlock);
+
+            // Woken up by the task's final suspension
+            builder->SetInsertPoint(waitBlock);
+            builder->CreateStore(coro.handle, builder->CreateStructGEP(getPromiseType(), taskPromise, 0));
+            createSuspend(/* final */ false);
+            builder->CreateBr(readyBlock);
+
+            fn->getBasicBlockList().push_back(readyBlock);
+            builder->SetInsertPoint(readyBlock);
+        }
+
+        auto result = builder->CreateLoad(builder->getInt32Ty(), builder->CreateStructGEP(getPromiseType(), taskPromise, 1), "awaited");
+        builder->CreateIntrinsic(llvm::Intrinsic::coro_destroy, {}, {task});
+
+        return result;
+    }
+
+    /**
+     * Promise of Eva tasks: { i8* waiter, i32 result }
+     */
+    llvm::StructType *getPromiseType()
+    {
+        if (auto existing = llvm::StructType::getTypeByName(*ctx, "Promise"))
+        {
+            return existing;
+        }
+
+        return llvm::StructType::create(*ctx, {builder->getInt8PtrTy(), builder->getInt32Ty()}, "Promise");
+    }
+
+    /**
+     * Start of the current function's entry block. Allocas get no source
+     * location: the instruction they're inserted before may belong to any
+     * expression, or another function.
+     */
+    void setVarsInsertPoint()
+    {
+        varsBuilder->SetInsertPoint(&fn->getEntryBlock(), fn->getEntryBlock().begin());
+        varsBuilder->SetCurrentDebugLocation(llvm::DebugLoc());
+    }
+
     llvm::Value *allocVar(const std::string &name, llvm::Type *type_, Env env)
     {
         // Explicitly put stuff at the entry point of
         // our current function, regardless of where
         // the main builder is
-        varsBuilder->SetInsertPoint(&fn->getEntryBlock());
+        setVarsInsertPoint();
 
         auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
 
@@ -505,11 +3720,47 @@ private:
         return llvm::BasicBlock::Create(*ctx, name, fn);
     }
 
+    /**
+     * Phase timings & counters of this compilation
+     */
+    CompileStats stats;
+
+    /**
+     * Profiled functions & loops (--instrument); a list, so probe
+     * pointers stay valid
+     */
+    std::list<ProfileProbe> profileProbes;
+
     /**
      * Currently compiling function
      */
     llvm::Function *fn;
 
+    /**
+     * Declared struct types, by name
+     */
+    std::map<std::string, StructLayout> structs;
+
+    /**
+     * Functions whose result only depends on their arguments
+     */
+    std::set<std::string> pureFunctions;
+
+    /**
+     * Files already imported
+     */
+    std::set<std::string> importedFiles;
+
+    /**
+     * SoA storage & view types -> layout of their element struct
+     */
+    std::map<llvm::Type *, StructLayout *> soaTypes;
+
+    /**
+     * Coroutine being compiled, if any
+     */
+    CoroState coro;
+
     /**
      * Owns & manages core 'global' data of LLVM's core infrastructure,
      * including type & constant unique tables
@@ -543,6 +3794,21 @@ private:
      * at a specific iterator location in a block
      */
     std::unique_ptr<llvm::IRBuilder<>> builder;
+
+    /**
+     * Code generation target (triple, CPU & features)
+     */
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+
+    /**
+     * Debug info (--debug-info / -g); null when disabled
+     */
+    std::unique_ptr<llvm::DIBuilder> diBuilder;
+
+    /**
+     * Source file of the compile unit
+     */
+    llvm::DIFile *debugFile = nullptr;
 };
 
 #endif
\ No newline at end of file
@@ -92,6 +92,17 @@ struct Exp {
   // Lists:
   Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
 
+  // Source location of the first token (line: 1-based, column: 0-based),
+  // 0 for expressions built by the compiler
+  int line = 0;
+  int column = 0;
+
+  Exp &at(int startLine, int startColumn) {
+    line = startLine;
+    column = startColumn;
+    return *this;
+  }
+
 };
 
 using Value = Exp; // clang-format on
@@ -338,6 +349,12 @@ enum class TokenType {
          */
         std::string yytext;
 
+        /**
+         * Location of the last shifted token, for semantic actions.
+         */
+        int yyline = 0;
+        int yycolumn = 0;
+
     private:
         /**
          * Captures token locations.
@@ -622,6 +639,8 @@ class EvaParser {
                     auto production = productions_[productionNumber];
 
                     tokenizer.yytext = shiftedToken->value;
+                    tokenizer.yyline = shiftedToken->startLine;
+                    tokenizer.yycolumn = shiftedToken->startColumn;
 
                     auto rhsLength = production.rhsLength;
                     while (rhsLength > 0)
@@ -736,7 +755,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(std::stoi(_1)).at(parser.tokenizer.yyline, parser.tokenizer.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -747,7 +766,7 @@ void _handler5(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1).at(parser.tokenizer.yyline, parser.tokenizer.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -758,7 +777,7 @@ void _handler6(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1).at(parser.tokenizer.yyline, parser.tokenizer.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -782,7 +801,7 @@ void _handler8(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+auto __ = Exp(std::vector<Exp>{}).at(parser.tokenizer.yyline, parser.tokenizer.yycolumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();